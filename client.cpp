@@ -20,11 +20,15 @@ limitations under the License.
 #include "coverage.h"
 #include "client.h"
 #include "directory.h"
+#include "wire.h"
+
+#include <errno.h>
 
 using namespace std;
 
 void CoverageClient::Init(int argc, char **argv) {
   keep_samples_in_memory = GetBinaryOption("-keep_samples_in_memory", argc, argv, true);
+  compress_samples = GetBinaryOption("-compress_samples", argc, argv, false);
 
   if (!keep_samples_in_memory) {
     char* out_dir = GetOption("-out", argc, argv);
@@ -60,6 +64,7 @@ void CoverageClient::Init(int argc, char **argv) {
 }
 
 CoverageClient::~CoverageClient() {
+  DisconnectFromServer();
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
   WSACleanup();
 #endif
@@ -85,30 +90,46 @@ int CoverageClient::TryConnectToServer() {
   server.sin_family = AF_INET;
   server.sin_port = htons(server_port);
 
+#ifdef SO_NOSIGPIPE
+  int nosigpipe = 1;
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (char *)&nosigpipe, sizeof(nosigpipe));
+#endif
+
   //Connect to remote server
   if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0)
   {
+    DisconnectFromServer();
     return 0;
   }
 
   return 1;
 }
 
+int CoverageClient::SendCommand(char command) {
+  char reply;
+  if (send(sock, &command, 1, SEND_FLAGS) != 1) return 0;
+  if (!Read(sock, &reply, 1)) return 0;
+  return (reply == 'K');
+}
+
 int CoverageClient::ConnectToServer(char command) {
   int sleeptime = 10000;
   int maxsleeptime = 5 * 60 * 1000;
-  char reply;
+
+  // reuse the existing connection if the server kept it open.
+  // Servers that handle a single command per connection
+  // will have closed it, in which case we simply reconnect
+  if (sock != INVALID_SOCKET) {
+    if (SendCommand(command)) return 1;
+    DisconnectFromServer();
+  }
+
   while (1) {
     if (TryConnectToServer()) {
-      send(sock, &command, 1, 0);
-      if (!Read(sock, &reply, 1)) {
-        DisconnectFromServer();
-      } else {
-        if (reply == 'K') {
-          break;
-        }
-        DisconnectFromServer();
+      if (SendCommand(command)) {
+        break;
       }
+      DisconnectFromServer();
     }
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
     Sleep(sleeptime);
@@ -122,34 +143,127 @@ int CoverageClient::ConnectToServer(char command) {
 }
 
 int CoverageClient::DisconnectFromServer() {
+  if (sock == INVALID_SOCKET) return 1;
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
   closesocket(sock);
 #else
   close(sock);
 #endif
+  sock = INVALID_SOCKET;
   return 1;
 }
 
 int CoverageClient::ReportCrash(Sample *crash, std::string &crash_desc) {
-  ConnectToServer('X');
-  send(sock, "S", 1, 0);
-  if (!SendSample(sock, *crash)) {
-    DisconnectFromServer();
-    return 0;
+  std::list<std::pair<Sample *, std::string>> crashes;
+  crashes.push_back({ crash, crash_desc });
+  return ReportCrashes(crashes);
+}
+
+void CoverageClient::AddKnownSample(Sample *sample) {
+  AddKnownSample(sample->GetHash());
+}
+
+void CoverageClient::AddKnownSample(uint64_t hash) {
+  known_samples_mutex.Lock();
+  known_sample_hashes.push_back(hash);
+  known_samples_mutex.Unlock();
+}
+
+int CoverageClient::GetWireVersion() {
+  if (wire_version) return wire_version;
+
+  ConnectToServer('V');
+
+  char version = WIRE_VERSION;
+  char reply;
+  int ret = -1;
+  if (send(sock, &version, 1, SEND_FLAGS) == 1) {
+    do {
+      ret = recv(sock, &reply, 1, 0);
+    } while ((ret < 0) && (errno == EINTR));
+  }
+
+  if (ret == 1) {
+    wire_version = reply;
+    return wire_version;
+  }
+
+  // servers that don't know the 'V' command acknowledge it and
+  // close the connection (which resets it if the version byte
+  // arrives after the close)
+  bool closed = (ret == 0);
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  if (ret < 0) {
+    int error = WSAGetLastError();
+    closed = (error == WSAECONNRESET) || (error == WSAECONNABORTED);
+  }
+#else
+  if (ret < 0) closed = (errno == ECONNRESET) || (errno == EPIPE);
+#endif
+  DisconnectFromServer();
+  if (closed) {
+    wire_version = 1;
+    return wire_version;
+  }
+
+  // anything else (e.g. a timeout) may be transient, so version 1,
+  // which every server understands, is only used for this request
+  // and the version is negotiated again on the next one
+  return 1;
+}
+
+int CoverageClient::ReportCrashes(std::list<std::pair<Sample *, std::string>> &crashes) {
+  int version = GetWireVersion();
+  ConnectToServer((version >= 2) ? 'x' : 'X');
+
+  WireWriter writer;
+  for (auto iter = crashes.begin(); iter != crashes.end(); iter++) {
+    writer.AppendByte('S');
+    if (version >= 2) {
+      AppendSampleV2(writer, *iter->first, compress_samples);
+    } else {
+      writer.AppendU64(iter->first->size);
+      writer.AppendRef(iter->first->bytes, iter->first->size);
+    }
+    writer.AppendU64(iter->second.size());
+    writer.Append(iter->second.data(), iter->second.size());
   }
-  if (!SendString(sock, crash_desc)) {
+  writer.AppendByte('N');
+
+  if (!writer.Flush(sock)) {
     DisconnectFromServer();
     return 0;
   }
-  send(sock, "N", 1, 0);
-  DisconnectFromServer();
   return 1;
 }
 
 int CoverageClient::ReportNewCoverage(Coverage *new_coverage, Sample *new_sample) {
-  ConnectToServer('S');
-  
-  SendCoverage(sock, *new_coverage);
+  std::list<Sample *> new_samples;
+  if (new_sample) new_samples.push_back(new_sample);
+  return ReportNewCoverage(new_coverage, new_samples);
+}
+
+int CoverageClient::ReportNewCoverage(Coverage *new_coverage, std::list<Sample *> &new_samples) {
+  int version = GetWireVersion();
+  if (version >= 3) {
+    ConnectToServer('r');
+  } else {
+    ConnectToServer((version >= 2) ? 'c' : 'S');
+  }
+
+  int ret;
+  if (version >= 2) {
+    WireWriter writer;
+    if (version >= 3) writer.AppendU64(client_id);
+    AppendCoverageV2(writer, *new_coverage);
+    ret = writer.Flush(sock);
+  } else {
+    ret = SendCoverage(sock, *new_coverage);
+  }
+  if (!ret) {
+    DisconnectFromServer();
+    return 0;
+  }
 
   char reply;
   if (!Read(sock, &reply, 1)) {
@@ -158,32 +272,82 @@ int CoverageClient::ReportNewCoverage(Coverage *new_coverage, Sample *new_sample
   }
 
   if (reply == 'N') {
-    DisconnectFromServer();
     return 1;
   }
 
-  if (new_sample) {
-    send(sock, "S", 1, 0);
-    if (!SendSample(sock, *new_sample)) {
-      DisconnectFromServer();
+  WireWriter writer;
+  for (auto iter = new_samples.begin(); iter != new_samples.end(); iter++) {
+    Sample *new_sample = *iter;
+    writer.AppendByte('S');
+    if (version >= 2) {
+      AppendSampleV2(writer, *new_sample, compress_samples);
+    } else {
+      writer.AppendU64(new_sample->size);
+      writer.AppendRef(new_sample->bytes, new_sample->size);
     }
   }
-  send(sock, "N", 1, 0);
+  writer.AppendByte('N');
+
+  if (!writer.Flush(sock)) {
+    DisconnectFromServer();
+    return 0;
+  }
 
-  DisconnectFromServer();
   return 1;
 }
 
-int CoverageClient::GetUpdates(std::list<Sample *> &new_samples, uint64_t total_execs) {
+int CoverageClient::GetUpdates(std::list<Sample *> &new_samples, ClientStats &stats,
+                               std::list<Coverage> *sample_coverage)
+{
   uint64_t server_timestamp;
   string module_name;
 
-  ConnectToServer('U');
+  int version = GetWireVersion();
+  bool with_coverage = sample_coverage && (version >= 5);
+  if (with_coverage) {
+    ConnectToServer('g');
+  } else if (version >= 4) {
+    ConnectToServer('q');
+  } else if (version >= 3) {
+    ConnectToServer('k');
+  } else {
+    ConnectToServer((version >= 2) ? 'u' : 'U');
+  }
 
-  send(sock, (char *)&client_id, sizeof(client_id), 0);
-  send(sock, (char *)&total_execs, sizeof(total_execs), 0);
+  state_mutex.Lock();
+  uint64_t timestamp = last_timestamp;
+  state_mutex.Unlock();
+
+  WireWriter writer;
+  writer.AppendU64(client_id);
+  writer.AppendU64(stats.total_execs);
+  writer.AppendU64(timestamp);
+
+  SampleBloomFilter known_samples;
+  if (version >= 3) {
+    known_samples_mutex.Lock();
+    known_samples.Init(known_sample_hashes.size());
+    for (auto iter = known_sample_hashes.begin(); iter != known_sample_hashes.end(); iter++) {
+      known_samples.Add(*iter);
+    }
+    known_samples_mutex.Unlock();
+
+    writer.AppendU64(known_samples.bits.size());
+    writer.AppendRef(&known_samples.bits[0], known_samples.bits.size() * sizeof(uint64_t));
+  }
+
+  std::string encoded_stats;
+  if (version >= 4) {
+    EncodeClientStats(stats, encoded_stats);
+    writer.AppendU64(encoded_stats.size());
+    writer.Append(encoded_stats.data(), encoded_stats.size());
+  }
+
+  if (!writer.Flush(sock)) {
+    DisconnectFromServer();
+    return 0;
+  }
 
-  send(sock, (char *)&last_timestamp, sizeof(last_timestamp), 0);
   if (!Read(sock, &server_timestamp, sizeof(server_timestamp))) {
     DisconnectFromServer();
     return 0;
@@ -201,21 +365,35 @@ int CoverageClient::GetUpdates(std::list<Sample *> &new_samples, uint64_t total_
     } else if (reply == 'S') {
       Sample *sample = new Sample();
 
-      if (!RecvSample(sock, *sample)) {
+      int ret = (version >= 2) ? RecvSampleV2(sock, *sample) : RecvSample(sock, *sample);
+      if (!ret) {
+        delete sample;
+        DisconnectFromServer();
+        return 0;
+      }
+
+      Coverage coverage;
+      if (with_coverage && !RecvCoverageV2(sock, coverage)) {
+        delete sample;
         DisconnectFromServer();
         return 0;
       }
+      if (sample_coverage) sample_coverage->push_back(coverage);
+
+      AddKnownSample(sample);
 
       if (!keep_samples_in_memory) {
+        state_mutex.Lock();
+        uint64_t sample_index = num_samples++;
+        state_mutex.Unlock();
+
         char fileindex[20];
-        sprintf(fileindex, "%05lld", num_samples);
+        sprintf(fileindex, "%05lld", sample_index);
         string filename = string("sample_") + fileindex;
         string outfile = DirJoin(sample_dir, filename);
         sample->filename = outfile;
         sample->Save();
         sample->FreeMemory();
-
-        num_samples++;
       }
 
       new_samples.push_back(sample);
@@ -225,21 +403,26 @@ int CoverageClient::GetUpdates(std::list<Sample *> &new_samples, uint64_t total_
     }
   }
 
+  state_mutex.Lock();
   last_timestamp = server_timestamp;
+  state_mutex.Unlock();
 
-  DisconnectFromServer();
   return 1;
 }
 
 void CoverageClient::SaveState(FILE* fp) {
+  state_mutex.Lock();
   fwrite(&last_timestamp, sizeof(last_timestamp), 1, fp);
   fwrite(&client_id, sizeof(last_timestamp), 1, fp);
   fwrite(&num_samples, sizeof(last_timestamp), 1, fp);
+  state_mutex.Unlock();
 }
 
 void CoverageClient::LoadState(FILE* fp) {
+  state_mutex.Lock();
   fread(&last_timestamp, sizeof(last_timestamp), 1, fp);
   fread(&client_id, sizeof(last_timestamp), 1, fp);
   fread(&num_samples, sizeof(last_timestamp), 1, fp);
+  state_mutex.Unlock();
 }
 
@@ -21,11 +21,13 @@ limitations under the License.
 #include "sample.h"
 #include "server.h"
 #include "prng.h"
+#include "mutex.h"
 
 class CoverageClient : public ServerCommon {
 public:
   CoverageClient() : last_timestamp(0), num_samples(0),
-    have_server(false), server_port(DEFAULT_SERVER_PORT)
+    have_server(false), server_port(DEFAULT_SERVER_PORT),
+    sock(INVALID_SOCKET), wire_version(0), compress_samples(false)
   {
     PRNG::SecureRandom(&client_id, sizeof(client_id));
   }
@@ -34,17 +36,31 @@ public:
   void Init(int argc, char **argv);
 
   int ReportNewCoverage(Coverage *new_coverage, Sample *new_sample);
-  int GetUpdates(std::list<Sample *> &new_samples, uint64_t total_execs);
+  int ReportNewCoverage(Coverage *new_coverage, std::list<Sample *> &new_samples);
+  // if sample_coverage is given, the coverage of each sample is
+  // added to it (empty if the server doesn't know or send it)
+  int GetUpdates(std::list<Sample *> &new_samples, ClientStats &stats,
+                 std::list<Coverage> *sample_coverage = NULL);
   int ReportCrash(Sample *crash, std::string &crash_desc);
+  int ReportCrashes(std::list<std::pair<Sample *, std::string>> &crashes);
+
+  // samples the fuzzer already has, the server won't send them back
+  void AddKnownSample(Sample *sample);
+  void AddKnownSample(uint64_t hash);
 
   void SaveState(FILE* fp);
   void LoadState(FILE* fp);
 
 private:
   int TryConnectToServer();
+  int SendCommand(char command);
+  int GetWireVersion();
   int ConnectToServer(char command);
   int DisconnectFromServer();
 
+  // the state saved by SaveState, protected by state_mutex
+  // so that it can be saved while a command is in progress
+  Mutex state_mutex;
   uint64_t last_timestamp;
   uint64_t client_id;
   uint64_t num_samples;
@@ -54,8 +70,17 @@ private:
 
   bool have_server;
 
+  // the connection is kept open between commands and
+  // is re-established when the server closes it
   socket_type sock;
 
+  Mutex known_samples_mutex;
+  std::vector<uint64_t> known_sample_hashes;
+
+  // negotiated on first use, 0 if not negotiated yet
+  int wire_version;
+  bool compress_samples;
+
   bool keep_samples_in_memory;
   std::string sample_dir;
 };
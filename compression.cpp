@@ -0,0 +1,132 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <inttypes.h>
+#include <string.h>
+#include <vector>
+
+#include "compression.h"
+
+#define MIN_MATCH 4
+#define MAX_MATCH (0x7f + MIN_MATCH)
+#define MAX_LITERAL_RUN 0x80
+#define MAX_OFFSET 0xffff
+
+#define HASH_BITS 14
+
+static inline uint32_t Read32(const char *p) {
+  uint32_t ret;
+  memcpy(&ret, p, sizeof(ret));
+  return ret;
+}
+
+static inline uint32_t Hash(const char *p) {
+  return (Read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void FlushLiterals(const char *literals, size_t num_literals, std::string &out) {
+  while (num_literals) {
+    size_t run = num_literals;
+    if (run > MAX_LITERAL_RUN) run = MAX_LITERAL_RUN;
+    out.push_back((char)(run - 1));
+    out.append(literals, run);
+    literals += run;
+    num_literals -= run;
+  }
+}
+
+size_t MaxCompressedSize(size_t size) {
+  return size + size / MAX_LITERAL_RUN + 1;
+}
+
+void Compress(const char *data, size_t size, std::string &out) {
+  // positions + 1 of the last occurrence of each hashed 4-byte sequence,
+  // 0 means no occurrence
+  std::vector<size_t> table((size_t)1 << HASH_BITS, 0);
+
+  size_t literal_start = 0;
+  size_t pos = 0;
+
+  while (pos + MIN_MATCH <= size) {
+    uint32_t hash = Hash(data + pos);
+    size_t candidate = table[hash];
+    table[hash] = pos + 1;
+
+    if (!candidate) {
+      pos++;
+      continue;
+    }
+    candidate--;
+
+    size_t offset = pos - candidate;
+    if (offset > MAX_OFFSET || Read32(data + candidate) != Read32(data + pos)) {
+      pos++;
+      continue;
+    }
+
+    size_t match_length = MIN_MATCH;
+    while ((pos + match_length < size) &&
+           (match_length < MAX_MATCH) &&
+           (data[candidate + match_length] == data[pos + match_length]))
+    {
+      match_length++;
+    }
+
+    FlushLiterals(data + literal_start, pos - literal_start, out);
+
+    out.push_back((char)(0x80 | (match_length - MIN_MATCH)));
+    out.push_back((char)(offset & 0xff));
+    out.push_back((char)(offset >> 8));
+
+    pos += match_length;
+    literal_start = pos;
+  }
+
+  FlushLiterals(data + literal_start, size - literal_start, out);
+}
+
+bool Decompress(const char *data, size_t size, char *out, size_t out_size) {
+  const unsigned char *in = (const unsigned char *)data;
+  const unsigned char *in_end = in + size;
+  size_t out_pos = 0;
+
+  while (in < in_end) {
+    unsigned char control = *in++;
+
+    if (control < 0x80) {
+      size_t run = (size_t)control + 1;
+      if ((size_t)(in_end - in) < run) return false;
+      if (out_size - out_pos < run) return false;
+      memcpy(out + out_pos, in, run);
+      in += run;
+      out_pos += run;
+    } else {
+      if (in_end - in < 2) return false;
+      size_t match_length = (size_t)(control & 0x7f) + MIN_MATCH;
+      size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+      in += 2;
+      if (!offset || offset > out_pos) return false;
+      if (out_size - out_pos < match_length) return false;
+      // byte by byte as the match can overlap with itself
+      for (size_t i = 0; i < match_length; i++) {
+        out[out_pos + i] = out[out_pos - offset + i];
+      }
+      out_pos += match_length;
+    }
+  }
+
+  return (out_pos == out_size);
+}
@@ -0,0 +1,36 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+// A small, dependency-free LZ77 codec used for sample payloads
+// on the wire. The compressed stream is a sequence of
+//  - literal runs: a byte 0x00-0x7f (run length - 1) followed by the literals
+//  - matches: a byte 0x80-0xff (match length - MIN_MATCH) followed
+//    by a 16-bit little-endian offset into the already decoded data
+
+// worst case size of the compressed data
+size_t MaxCompressedSize(size_t size);
+
+// appends the compressed data to out
+void Compress(const char *data, size_t size, std::string &out);
+
+// returns false if the data is malformed or
+// doesn't decompress to exactly out_size bytes
+bool Decompress(const char *data, size_t size, char *out, size_t out_size);
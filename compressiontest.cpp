@@ -0,0 +1,316 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+// Checks that the wire compression and the varint coverage encoding
+// round-trip, and that decoding truncated or corrupted input fails
+// (without writing out of bounds, in the case of decompression)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "compression.h"
+#include "wire.h"
+
+// bytes past the end of the output buffer that must stay untouched
+#define GUARD_SIZE 256
+#define GUARD_BYTE 0xAA
+
+int num_failures = 0;
+
+void Check(bool condition, const char *test, const char *what) {
+  if (condition) return;
+  printf("FAILED: %s: %s\n", test, what);
+  num_failures++;
+}
+
+// decompresses into a buffer with guard bytes after out_size
+bool DecompressGuarded(std::string &compressed, size_t out_size, std::vector<char> &out, const char *test) {
+  out.assign(out_size + GUARD_SIZE, (char)GUARD_BYTE);
+  bool ret = Decompress(compressed.data(), compressed.size(), out.data(), out_size);
+  for (size_t i = out_size; i < out.size(); i++) {
+    if (out[i] != (char)GUARD_BYTE) {
+      Check(false, test, "wrote past the end of the output");
+      break;
+    }
+  }
+  return ret;
+}
+
+void TestRoundTrip(std::string &data, const char *test) {
+  std::string compressed;
+  Compress(data.data(), data.size(), compressed);
+  Check(compressed.size() <= MaxCompressedSize(data.size()), test, "exceeds MaxCompressedSize");
+
+  std::vector<char> out;
+  bool ok = DecompressGuarded(compressed, data.size(), out, test);
+  Check(ok, test, "round trip failed");
+  Check(ok && (memcmp(out.data(), data.data(), data.size()) == 0), test, "round trip mismatch");
+
+  // the size is part of the format, neither more nor less may be accepted
+  if (data.size()) {
+    Check(!DecompressGuarded(compressed, data.size() - 1, out, test), test, "accepted a smaller output size");
+  }
+  Check(!DecompressGuarded(compressed, data.size() + 1, out, test), test, "accepted a larger output size");
+
+  // no proper prefix decompresses to the full size
+  for (size_t i = 0; i < compressed.size(); i++) {
+    std::string truncated = compressed.substr(0, i);
+    if (DecompressGuarded(truncated, data.size(), out, test)) {
+      Check(false, test, "accepted a truncated stream");
+      break;
+    }
+  }
+}
+
+void TestRoundTrips() {
+  std::string data;
+  TestRoundTrip(data, "empty");
+
+  data = "a";
+  TestRoundTrip(data, "one byte");
+
+  data = "abc";
+  TestRoundTrip(data, "shorter than a match");
+
+  data.assign(100000, 'a');
+  TestRoundTrip(data, "one repeated byte");
+
+  data.clear();
+  for (int i = 0; i < 5000; i++) data += "Hello, world " + std::to_string(i % 97) + "\n";
+  TestRoundTrip(data, "text");
+
+  data.clear();
+  for (int i = 0; i < 300000; i++) data.push_back((char)rand());
+  TestRoundTrip(data, "random");
+
+  // repeats further apart than the largest offset
+  std::string block;
+  for (int i = 0; i < 70000; i++) block.push_back((char)rand());
+  data = block + block + block;
+  TestRoundTrip(data, "distant repeats");
+
+  // literal runs and matches of every length around their limits
+  data.clear();
+  for (int len = 1; len < 300; len++) {
+    for (int i = 0; i < len; i++) data.push_back((char)rand());
+    data.append(len, (char)len);
+  }
+  TestRoundTrip(data, "mixed runs");
+}
+
+void TestMalformed() {
+  std::vector<char> out;
+  std::string stream;
+
+  // a match at the start refers to data that doesn't exist
+  stream = std::string("\x80\x01\x00", 3);
+  Check(!DecompressGuarded(stream, 4, out, "malformed"), "malformed", "match before any data");
+
+  // zero offset
+  stream = std::string("\x00" "a" "\x80\x00\x00", 5);
+  Check(!DecompressGuarded(stream, 5, out, "malformed"), "malformed", "zero offset");
+
+  // offset past the decoded data
+  stream = std::string("\x00" "a" "\x80\x02\x00", 5);
+  Check(!DecompressGuarded(stream, 5, out, "malformed"), "malformed", "offset past the decoded data");
+
+  // match longer than the output
+  stream = std::string("\x00" "a" "\xff\x01\x00", 5);
+  Check(!DecompressGuarded(stream, 10, out, "malformed"), "malformed", "match past the output size");
+
+  // literal run longer than the output
+  stream = std::string("\x03" "abcd", 5);
+  Check(!DecompressGuarded(stream, 2, out, "malformed"), "malformed", "literals past the output size");
+
+  // literal run longer than the input
+  stream = std::string("\x7f" "abcd", 5);
+  Check(!DecompressGuarded(stream, 128, out, "malformed"), "malformed", "literals past the input");
+
+  // match missing its offset
+  stream = std::string("\x00" "a" "\x80\x01", 4);
+  Check(!DecompressGuarded(stream, 5, out, "malformed"), "malformed", "truncated offset");
+}
+
+void TestCorrupted() {
+  std::string data;
+  for (int i = 0; i < 2000; i++) data += "sample " + std::to_string(rand() % 50) + " ";
+  std::string compressed;
+  Compress(data.data(), data.size(), compressed);
+
+  std::vector<char> out;
+
+  // flipped bytes may still decompress to something, but
+  // never past the output or with a different size
+  for (int i = 0; i < 20000; i++) {
+    std::string corrupted = compressed;
+    int num_flips = 1 + rand() % 4;
+    for (int j = 0; j < num_flips; j++) {
+      corrupted[rand() % corrupted.size()] ^= (char)(1 + rand() % 255);
+    }
+    DecompressGuarded(corrupted, data.size(), out, "corrupted");
+  }
+
+  // random streams with random output sizes
+  for (int i = 0; i < 20000; i++) {
+    std::string garbage;
+    size_t size = rand() % 64;
+    for (size_t j = 0; j < size; j++) garbage.push_back((char)rand());
+    DecompressGuarded(garbage, rand() % 512, out, "garbage");
+  }
+}
+
+void TestVarint(uint64_t value) {
+  std::string encoded;
+  EncodeVarint(value, encoded);
+
+  const char *data = encoded.data();
+  const char *end = data + encoded.size();
+  uint64_t decoded;
+  bool ok = DecodeVarint(&data, end, &decoded);
+  Check(ok && (decoded == value), "varint", "round trip failed");
+  Check(data == end, "varint", "didn't consume the whole encoding");
+
+  for (size_t i = 0; i < encoded.size(); i++) {
+    data = encoded.data();
+    if (DecodeVarint(&data, data + i, &decoded)) {
+      Check(false, "varint", "accepted a truncated varint");
+      break;
+    }
+  }
+}
+
+void TestVarints() {
+  uint64_t values[] = {
+    0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffff,
+    0x100000000ULL, 0x7fffffffffffffffULL, 0xffffffffffffffffULL
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    TestVarint(values[i]);
+  }
+  for (int i = 0; i < 10000; i++) {
+    TestVarint(((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ (uint64_t)rand());
+  }
+
+  uint64_t decoded;
+  const char *data;
+
+  // 11 bytes, longer than any 64-bit value needs
+  std::string overlong(10, '\x80');
+  overlong.push_back(0);
+  data = overlong.data();
+  Check(!DecodeVarint(&data, data + overlong.size(), &decoded), "varint", "accepted an 11 byte varint");
+
+  // 10 bytes with bits set past the 64th
+  overlong = std::string(9, '\xff') + std::string("\x02", 1);
+  data = overlong.data();
+  Check(!DecodeVarint(&data, data + overlong.size(), &decoded), "varint", "accepted bits past 64");
+}
+
+bool CoverageEqual(Coverage &a, Coverage &b) {
+  if (a.size() != b.size()) return false;
+  auto iter_b = b.begin();
+  for (auto iter_a = a.begin(); iter_a != a.end(); iter_a++, iter_b++) {
+    if (iter_a->module_name != iter_b->module_name) return false;
+    if (iter_a->offsets != iter_b->offsets) return false;
+  }
+  return true;
+}
+
+void AddModule(Coverage &coverage, const char *name, std::set<uint64_t> &offsets) {
+  std::string module_name(name);
+  coverage.push_back({ module_name, offsets });
+}
+
+void TestCoverage() {
+  Coverage coverage;
+  std::string encoded;
+  Coverage decoded;
+
+  EncodeCoverage(coverage, encoded);
+  Check(DecodeCoverage(encoded.data(), encoded.size(), decoded) && decoded.empty(),
+        "coverage", "empty coverage round trip failed");
+
+  std::set<uint64_t> offsets;
+  offsets.insert(0);
+  offsets.insert(1);
+  offsets.insert(0x1000);
+  offsets.insert(0x0000123400005678ULL);
+  offsets.insert(0xffffffffffffffffULL);
+  AddModule(coverage, "target.exe", offsets);
+  offsets.clear();
+  for (int i = 0; i < 5000; i++) offsets.insert(rand() % 1000000);
+  AddModule(coverage, "library.so", offsets);
+  offsets.clear();
+  AddModule(coverage, "empty.so", offsets);
+
+  encoded.clear();
+  EncodeCoverage(coverage, encoded);
+  decoded.clear();
+  bool ok = DecodeCoverage(encoded.data(), encoded.size(), decoded);
+  Check(ok && CoverageEqual(coverage, decoded), "coverage", "round trip failed");
+
+  for (size_t i = 0; i < encoded.size(); i++) {
+    decoded.clear();
+    if (DecodeCoverage(encoded.data(), i, decoded)) {
+      Check(false, "coverage", "accepted truncated coverage");
+      break;
+    }
+  }
+
+  std::string trailing = encoded + "x";
+  decoded.clear();
+  Check(!DecodeCoverage(trailing.data(), trailing.size(), decoded), "coverage", "accepted trailing bytes");
+
+  // one module whose name or offset count exceeds the input
+  std::string malformed;
+  EncodeVarint(1, malformed);
+  EncodeVarint(1000, malformed);
+  malformed += "abc";
+  decoded.clear();
+  Check(!DecodeCoverage(malformed.data(), malformed.size(), decoded), "coverage", "name past the input");
+
+  malformed.clear();
+  EncodeVarint(1, malformed);
+  EncodeVarint(1, malformed);
+  malformed += "a";
+  EncodeVarint(0xffffffffffffffffULL, malformed);
+  malformed += "\x01\x01";
+  decoded.clear();
+  Check(!DecodeCoverage(malformed.data(), malformed.size(), decoded), "coverage", "offset count past the input");
+}
+
+int main() {
+  srand(1);
+
+  TestRoundTrips();
+  TestMalformed();
+  TestCorrupted();
+  TestVarints();
+  TestCoverage();
+
+  if (num_failures) {
+    printf("%d checks failed\n", num_failures);
+    return 1;
+  }
+
+  printf("All compression and wire encoding tests passed\n");
+  return 0;
+}
@@ -0,0 +1,210 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+
+#include "common.h"
+#include "corpusindex.h"
+#include "wire.h"
+
+struct CandidateSample {
+  double score;
+  size_t sample_id;
+};
+
+struct CmpCandidates {
+  bool operator()(const CandidateSample &lhs, const CandidateSample &rhs) const {
+    if (lhs.score == rhs.score) {
+      // prefer samples that come first in the corpus
+      return lhs.sample_id > rhs.sample_id;
+    }
+    return lhs.score < rhs.score;
+  }
+};
+
+// the index can be larger than 2GB
+static void SeekIndex(FILE *fp, uint64_t offset, int origin) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  _fseeki64(fp, (__int64)offset, origin);
+#else
+  fseeko(fp, (off_t)offset, origin);
+#endif
+}
+
+CorpusIndex::CorpusIndex() {
+  index_fp = NULL;
+  index_size = 0;
+  edge_count = 0;
+  sample_count = 0;
+}
+
+CorpusIndex::~CorpusIndex() {
+  if (index_fp) {
+    fclose(index_fp);
+    remove(index_filename.c_str());
+  }
+}
+
+void CorpusIndex::Init(std::string &filename) {
+  index_filename = filename;
+  index_fp = fopen(filename.c_str(), "w+b");
+  if (!index_fp) FATAL("Error creating corpus index file %s", filename.c_str());
+}
+
+// called with mutex locked
+uint32_t CorpusIndex::GetEdgeId(size_t module_id, uint64_t offset) {
+  auto iter = edge_ids[module_id].find(offset);
+  if (iter != edge_ids[module_id].end()) return iter->second;
+
+  uint32_t id = (uint32_t)edge_count;
+  edge_ids[module_id][offset] = id;
+  edge_count++;
+  return id;
+}
+
+void CorpusIndex::AddSample(size_t sample_id, uint64_t size, uint64_t exec_time, Coverage &coverage) {
+  std::vector<uint32_t> edges;
+
+  mutex.Lock();
+
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    size_t module_id;
+    auto module_iter = module_ids.find(iter->module_name);
+    if (module_iter == module_ids.end()) {
+      module_id = edge_ids.size();
+      module_ids[iter->module_name] = module_id;
+      edge_ids.resize(module_id + 1);
+    } else {
+      module_id = module_iter->second;
+    }
+
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      edges.push_back(GetEdgeId(module_id, *iter2));
+    }
+  }
+
+  if (edges.empty()) {
+    mutex.Unlock();
+    return;
+  }
+
+  std::sort(edges.begin(), edges.end());
+
+  // edge ids are sorted, so only deltas are encoded
+  std::string encoded;
+  uint32_t last_edge = 0;
+  for (size_t i = 0; i < edges.size(); i++) {
+    EncodeVarint(edges[i] - last_edge, encoded);
+    last_edge = edges[i];
+  }
+
+  SeekIndex(index_fp, 0, SEEK_END);
+  if (fwrite(encoded.data(), 1, encoded.size(), index_fp) != encoded.size()) {
+    FATAL("Error writing corpus index file");
+  }
+
+  if (records.size() <= sample_id) {
+    records.resize(sample_id + 1, { 0, 0, 0, 0 });
+  }
+  SampleRecord &record = records[sample_id];
+  record.index_offset = index_size;
+  record.index_size = (uint32_t)encoded.size();
+  record.num_edges = (uint32_t)edges.size();
+  record.cost = CMIN_SAMPLE_COST + (double)size + CMIN_EXEC_TIME_COST * (double)exec_time;
+
+  index_size += encoded.size();
+  sample_count++;
+
+  mutex.Unlock();
+}
+
+void CorpusIndex::ReadSampleEdges(SampleRecord &record, std::vector<uint32_t> &edges) {
+  std::string encoded;
+  encoded.resize(record.index_size);
+
+  SeekIndex(index_fp, record.index_offset, SEEK_SET);
+  if (fread(&encoded[0], 1, encoded.size(), index_fp) != encoded.size()) {
+    FATAL("Error reading corpus index file");
+  }
+
+  edges.clear();
+  const char *p = encoded.data();
+  const char *end = p + encoded.size();
+  uint64_t edge = 0;
+  for (uint32_t i = 0; i < record.num_edges; i++) {
+    uint64_t delta;
+    if (!DecodeVarint(&p, end, &delta)) FATAL("Corrupt corpus index file");
+    edge += delta;
+    edges.push_back((uint32_t)edge);
+  }
+}
+
+void CorpusIndex::Solve(std::vector<size_t> &selected) {
+  mutex.Lock();
+
+  fflush(index_fp);
+
+  std::vector<bool> covered(edge_count, false);
+  size_t num_covered = 0;
+
+  // The number of uncovered edges a sample adds can only go down
+  // as samples are selected, so scores in the queue are upper
+  // bounds and only the top candidate needs to be re-evaluated
+  // (lazy greedy). This keeps the number of index reads low.
+  std::priority_queue<CandidateSample, std::vector<CandidateSample>, CmpCandidates> candidates;
+  for (size_t i = 0; i < records.size(); i++) {
+    if (!records[i].num_edges) continue;
+    candidates.push({ records[i].num_edges / records[i].cost, i });
+  }
+
+  std::vector<uint32_t> edges;
+  while (!candidates.empty() && (num_covered < edge_count)) {
+    CandidateSample candidate = candidates.top();
+    candidates.pop();
+
+    SampleRecord &record = records[candidate.sample_id];
+    ReadSampleEdges(record, edges);
+
+    size_t new_edges = 0;
+    for (size_t i = 0; i < edges.size(); i++) {
+      if (!covered[edges[i]]) new_edges++;
+    }
+    if (!new_edges) continue;
+
+    double score = new_edges / record.cost;
+    if (!candidates.empty() && (score < candidates.top().score)) {
+      candidates.push({ score, candidate.sample_id });
+      continue;
+    }
+
+    for (size_t i = 0; i < edges.size(); i++) {
+      if (!covered[edges[i]]) {
+        covered[edges[i]] = true;
+        num_covered++;
+      }
+    }
+    selected.push_back(candidate.sample_id);
+  }
+
+  mutex.Unlock();
+
+  std::sort(selected.begin(), selected.end());
+}
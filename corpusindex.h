@@ -0,0 +1,82 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "coverage.h"
+#include "mutex.h"
+
+// the cost of a sample for corpus minimization is its size in
+// bytes plus CMIN_SAMPLE_COST per sample and CMIN_EXEC_TIME_COST
+// per ms of execution time, so that the distilled corpus favors
+// fewer, smaller and faster samples
+#define CMIN_SAMPLE_COST 1024
+#define CMIN_EXEC_TIME_COST 1024
+
+// Coverage of every sample in a corpus, for -cmin.
+// Edges are mapped to consecutive ids and the per-sample
+// edge lists are written to an index file as they come in,
+// so only the edge ids and a fixed-size record per sample
+// are kept in memory
+class CorpusIndex {
+public:
+  CorpusIndex();
+  ~CorpusIndex();
+
+  void Init(std::string &filename);
+
+  // can be called from multiple threads
+  void AddSample(size_t sample_id, uint64_t size, uint64_t exec_time, Coverage &coverage);
+
+  // greedy weighted set cover: repeatedly selects the sample that
+  // covers the most not yet covered edges per unit of cost, until
+  // all edges are covered. Returns the selected sample ids
+  void Solve(std::vector<size_t> &selected);
+
+  size_t GetNumEdges() { return edge_count; }
+  size_t GetNumSamples() { return sample_count; }
+
+protected:
+  struct SampleRecord {
+    uint64_t index_offset;
+    uint32_t index_size;
+    uint32_t num_edges;
+    double cost;
+  };
+
+  uint32_t GetEdgeId(size_t module_id, uint64_t offset);
+  void ReadSampleEdges(SampleRecord &record, std::vector<uint32_t> &edges);
+
+  Mutex mutex;
+  FILE *index_fp;
+  std::string index_filename;
+  uint64_t index_size;
+
+  std::unordered_map<std::string, size_t> module_ids;
+  std::vector<std::unordered_map<uint64_t, uint32_t>> edge_ids;
+  size_t edge_count;
+
+  // indexed by sample id, num_edges is 0 for missing samples
+  std::vector<SampleRecord> records;
+  size_t sample_count;
+};
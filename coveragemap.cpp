@@ -0,0 +1,258 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+
+#include "common.h"
+#include "coveragemap.h"
+
+CoverageMap::CoverageMap() : num_modules(0), num_offsets(0) {
+  memset(modules, 0, sizeof(modules));
+}
+
+CoverageMap::~CoverageMap() {
+  size_t count = num_modules.load();
+  for (size_t i = 0; i < count; i++) {
+    Module *module = modules[i];
+    for (size_t j = 0; j < COVERAGE_MAP_SHARDS; j++) {
+      Shard *shard = &module->shards[j];
+      DeleteTable(shard->table.load());
+      for (auto iter = shard->old_tables.begin(); iter != shard->old_tables.end(); iter++) {
+        DeleteTable(*iter);
+      }
+    }
+    delete module;
+  }
+}
+
+// spreads the offsets over shards (high bits) and slots (low bits)
+static uint64_t HashOffset(uint64_t offset) {
+  offset ^= offset >> 33;
+  offset *= 0xff51afd7ed558ccdULL;
+  offset ^= offset >> 33;
+  offset *= 0xc4ceb9fe1a85ec53ULL;
+  offset ^= offset >> 33;
+  return offset;
+}
+
+CoverageMap::Table *CoverageMap::CreateTable(size_t num_slots) {
+  Table *table = new Table;
+  table->num_slots = num_slots;
+  table->slots = new std::atomic<uint64_t>[num_slots];
+  for (size_t i = 0; i < num_slots; i++) {
+    table->slots[i].store(0, std::memory_order_relaxed);
+  }
+  return table;
+}
+
+void CoverageMap::DeleteTable(Table *table) {
+  delete [] table->slots;
+  delete table;
+}
+
+CoverageMap::Module *CoverageMap::GetModule(const std::string &name, bool create) {
+  size_t count = num_modules.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    if (modules[i]->name == name) return modules[i];
+  }
+
+  if (!create) return NULL;
+
+  modules_mutex.Lock();
+
+  // another thread could have added the module in the meantime
+  count = num_modules.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    if (modules[i]->name == name) {
+      modules_mutex.Unlock();
+      return modules[i];
+    }
+  }
+
+  if (count >= MAX_COVERAGE_MAP_MODULES) {
+    modules_mutex.Unlock();
+    return NULL;
+  }
+
+  Module *module = new Module;
+  module->name = name;
+  for (size_t i = 0; i < COVERAGE_MAP_SHARDS; i++) {
+    Shard *shard = &module->shards[i];
+    shard->table.store(CreateTable(COVERAGE_SHARD_INITIAL_SLOTS), std::memory_order_relaxed);
+    shard->has_zero.store(false, std::memory_order_relaxed);
+    shard->num_keys = 0;
+  }
+
+  modules[count] = module;
+  num_modules.store(count + 1, std::memory_order_release);
+
+  modules_mutex.Unlock();
+
+  return module;
+}
+
+CoverageMap::Shard *CoverageMap::GetShard(Module *module, uint64_t offset) {
+  return &module->shards[HashOffset(offset) >> (64 - COVERAGE_MAP_SHARD_BITS)];
+}
+
+bool CoverageMap::Contains(Shard *shard, uint64_t offset) {
+  if (!offset) return shard->has_zero.load(std::memory_order_acquire);
+
+  // a table that was replaced in the meantime could miss the
+  // most recent offsets, which only makes them look new
+  Table *table = shard->table.load(std::memory_order_acquire);
+  size_t mask = table->num_slots - 1;
+  size_t slot = (size_t)HashOffset(offset) & mask;
+
+  // tables are never more than half full, so there is always an empty slot
+  while (1) {
+    uint64_t key = table->slots[slot].load(std::memory_order_acquire);
+    if (key == offset) return true;
+    if (!key) return false;
+    slot = (slot + 1) & mask;
+  }
+}
+
+bool CoverageMap::Insert(Shard *shard, uint64_t offset) {
+  if (!offset) {
+    if (shard->has_zero.load(std::memory_order_relaxed)) return false;
+    shard->has_zero.store(true, std::memory_order_release);
+    return true;
+  }
+
+  Table *table = shard->table.load(std::memory_order_relaxed);
+
+  if ((shard->num_keys + 1) * 2 > table->num_slots) {
+    // the new table is filled before it's published, lookups
+    // keep using the old one (which stays valid) until then
+    Table *new_table = CreateTable(table->num_slots * 2);
+    size_t new_mask = new_table->num_slots - 1;
+    for (size_t i = 0; i < table->num_slots; i++) {
+      uint64_t key = table->slots[i].load(std::memory_order_relaxed);
+      if (!key) continue;
+      size_t slot = (size_t)HashOffset(key) & new_mask;
+      while (new_table->slots[slot].load(std::memory_order_relaxed)) {
+        slot = (slot + 1) & new_mask;
+      }
+      new_table->slots[slot].store(key, std::memory_order_relaxed);
+    }
+    shard->table.store(new_table, std::memory_order_release);
+    shard->old_tables.push_back(table);
+    table = new_table;
+  }
+
+  size_t mask = table->num_slots - 1;
+  size_t slot = (size_t)HashOffset(offset) & mask;
+  while (1) {
+    uint64_t key = table->slots[slot].load(std::memory_order_relaxed);
+    if (key == offset) return false;
+    if (!key) break;
+    slot = (slot + 1) & mask;
+  }
+
+  table->slots[slot].store(offset, std::memory_order_release);
+  shard->num_keys++;
+  return true;
+}
+
+bool CoverageMap::HasNewCoverage(Coverage &coverage) {
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->offsets.empty()) continue;
+
+    Module *module = GetModule(iter->module_name, false);
+    if (!module) return true;
+
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      if (!Contains(GetShard(module, *iter2), *iter2)) return true;
+    }
+  }
+
+  return false;
+}
+
+bool CoverageMap::HasRoomFor(Coverage &coverage) {
+  size_t num_missing = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->offsets.empty()) continue;
+    if (!GetModule(iter->module_name, false)) num_missing++;
+  }
+
+  size_t count = num_modules.load(std::memory_order_acquire);
+  return (num_missing <= (MAX_COVERAGE_MAP_MODULES - count));
+}
+
+bool CoverageMap::Merge(Coverage &coverage, Coverage *new_coverage) {
+  bool ret = false;
+
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    if (iter->offsets.empty()) continue;
+
+    Module *module = GetModule(iter->module_name, true);
+    if (!module) continue;
+    ModuleCoverage *new_module_coverage = NULL;
+
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      uint64_t offset = *iter2;
+      Shard *shard = GetShard(module, offset);
+
+      // only offsets that look new need the lock
+      if (Contains(shard, offset)) continue;
+
+      shard->mutex.Lock();
+      bool inserted = Insert(shard, offset);
+      shard->mutex.Unlock();
+      if (!inserted) continue;
+
+      num_offsets.fetch_add(1, std::memory_order_relaxed);
+      ret = true;
+      if (!new_coverage) continue;
+      if (!new_module_coverage) {
+        new_module_coverage = GetModuleCoverage(*new_coverage, iter->module_name);
+      }
+      if (!new_module_coverage) {
+        new_coverage->push_back({ iter->module_name, {} });
+        new_module_coverage = &new_coverage->back();
+      }
+      new_module_coverage->offsets.insert(new_module_coverage->offsets.end(), offset);
+    }
+  }
+
+  return ret;
+}
+
+void CoverageMap::GetCoverage(Coverage &coverage) {
+  size_t count = num_modules.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    Module *module = modules[i];
+    coverage.push_back({ module->name, {} });
+    ModuleCoverage *module_coverage = &coverage.back();
+
+    for (size_t j = 0; j < COVERAGE_MAP_SHARDS; j++) {
+      Shard *shard = &module->shards[j];
+      if (shard->has_zero.load(std::memory_order_acquire)) {
+        module_coverage->offsets.insert(0);
+      }
+
+      Table *table = shard->table.load(std::memory_order_acquire);
+      for (size_t k = 0; k < table->num_slots; k++) {
+        uint64_t key = table->slots[k].load(std::memory_order_relaxed);
+        if (key) module_coverage->offsets.insert(key);
+      }
+    }
+
+    if (module_coverage->offsets.empty()) coverage.pop_back();
+  }
+}
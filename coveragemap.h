@@ -0,0 +1,109 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "coverage.h"
+#include "mutex.h"
+
+// offsets of each module are spread over this many shards (power of 2)
+// by their hash, so that concurrent reports rarely touch the same shard
+#define COVERAGE_MAP_SHARD_BITS 6
+#define COVERAGE_MAP_SHARDS (1 << COVERAGE_MAP_SHARD_BITS)
+
+// the hash table of each shard starts with this many slots (power of 2)
+// and doubles whenever it gets half full
+#define COVERAGE_SHARD_INITIAL_SLOTS 64
+
+#define MAX_COVERAGE_MAP_MODULES 1024
+
+// Coverage of all clients, stored as hash sets of offsets.
+// The offsets of each module are split into shards by their hash,
+// and each shard is an open addressing hash table, so the memory
+// used depends only on the number of offsets and not on how they
+// are spread (e.g. edges are encoded as (from << 32) + to).
+// Checking for new coverage doesn't take any locks. Adding an offset
+// takes the lock of its shard, which is also when a full table gets
+// replaced by a larger one. Replaced tables are kept until the map
+// is destroyed, so that lookups never need a lock
+class CoverageMap {
+public:
+  CoverageMap();
+  ~CoverageMap();
+
+  // true if any offset of the coverage isn't in the map yet
+  bool HasNewCoverage(Coverage &coverage);
+
+  // false if the coverage has modules that aren't in the map
+  // and can't be added anymore (see MAX_COVERAGE_MAP_MODULES)
+  bool HasRoomFor(Coverage &coverage);
+
+  // adds the coverage to the map. Each offset is reported as
+  // new to exactly one caller, even if several callers add it
+  // at the same time. Modules that don't fit into the map are
+  // skipped. Returns true if anything was new
+  bool Merge(Coverage &coverage, Coverage *new_coverage);
+
+  // everything in the map, used for persisting it
+  void GetCoverage(Coverage &coverage);
+
+  uint64_t GetNumOffsets() { return num_offsets.load(std::memory_order_relaxed); }
+
+protected:
+  struct Table {
+    size_t num_slots;
+    // 0 marks an empty slot, offset 0 is tracked by the shard
+    std::atomic<uint64_t> *slots;
+  };
+
+  struct Shard {
+    std::atomic<Table *> table;
+    std::atomic<bool> has_zero;
+    // the rest is protected by mutex
+    Mutex mutex;
+    size_t num_keys;
+    std::vector<Table *> old_tables;
+  };
+
+  struct Module {
+    std::string name;
+    Shard shards[COVERAGE_MAP_SHARDS];
+  };
+
+  // returns NULL if the module isn't in the map and
+  // either create is false or the map is full
+  Module *GetModule(const std::string &name, bool create);
+  Shard *GetShard(Module *module, uint64_t offset);
+
+  Table *CreateTable(size_t num_slots);
+  void DeleteTable(Table *table);
+
+  bool Contains(Shard *shard, uint64_t offset);
+  // called with the shard lock held
+  bool Insert(Shard *shard, uint64_t offset);
+
+  // published modules never change
+  Module *modules[MAX_COVERAGE_MAP_MODULES];
+  std::atomic<size_t> num_modules;
+  Mutex modules_mutex;
+
+  std::atomic<uint64_t> num_offsets;
+};
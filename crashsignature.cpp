@@ -0,0 +1,165 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "crashsignature.h"
+#include "instrumentation.h"
+
+#define STACK_HASH_SEED 0x811c9dc5
+#define STACK_HASH_PRIME 0x01000193
+
+static std::string SanitizeName(const char *str, size_t len) {
+  std::string ret;
+  for (size_t i = 0; i < len; i++) {
+    if (isalnum(str[i]) || str[i] == '-' || str[i] == '_') {
+      ret.push_back(str[i]);
+    } else {
+      ret.push_back('_');
+    }
+  }
+  return ret;
+}
+
+void CrashSignature::ParseBugType(const char *report) {
+  // e.g. "ERROR: AddressSanitizer: heap-buffer-overflow on address ..."
+  const char *error = strstr(report, "ERROR: ");
+  const char *type = error ? strstr(error, "Sanitizer: ") : NULL;
+  if (!type) {
+    bug_type = "unknown";
+    return;
+  }
+  type += strlen("Sanitizer: ");
+  const char *type_end = type;
+  while (*type_end && !isspace(*type_end)) type_end++;
+  bug_type = SanitizeName(type, type_end - type);
+
+  // access type, either "READ of size N" (memory errors)
+  // or "caused by a READ memory access" (SEGV)
+  const char *read = strstr(type_end, "READ of size");
+  if (!read) read = strstr(type_end, "a READ memory access");
+  const char *write = strstr(type_end, "WRITE of size");
+  if (!write) write = strstr(type_end, "a WRITE memory access");
+  if (read && (!write || read < write)) {
+    bug_type += "_READ";
+  } else if (write) {
+    bug_type += "_WRITE";
+  }
+}
+
+// "#0 0x4f6b1a in foo(char*) /src/foo.cc:12:3" or
+// "#1 0x7f3c in __libc_start_main (/lib/libc.so.6+0x21b96)" or
+// "#2 0x55d1  (/path/target+0x1234)"
+bool CrashSignature::ParseFrame(const char *line, size_t len) {
+  std::string frame_line(line, len);
+  const char *start = frame_line.c_str();
+
+  while (isspace(*start)) start++;
+  if (*start != '#' || !isdigit(start[1])) return false;
+
+  const char *pc = strstr(start, " 0x");
+  if (!pc) return false;
+  uint64_t pc_value = strtoull(pc + 1, NULL, 16);
+  if (frames.empty()) first_pc = pc_value;
+
+  // module+offset is the most stable representation
+  // as it doesn't depend on ASLR or symbolization
+  size_t module_end = frame_line.rfind(')');
+  size_t module_start = frame_line.rfind('(', module_end);
+  if (module_end != std::string::npos && module_start != std::string::npos) {
+    std::string module = frame_line.substr(module_start + 1, module_end - module_start - 1);
+    size_t plus = module.rfind("+0x");
+    if (plus != std::string::npos) {
+      size_t slash = module.rfind('/', plus);
+      size_t name_start = (slash == std::string::npos) ? 0 : slash + 1;
+      frames.push_back(module.substr(name_start));
+      return true;
+    }
+  }
+
+  // otherwise, a symbolized function name
+  const char *in = strstr(pc + 1, " in ");
+  if (in) {
+    const char *function = in + 4;
+    const char *function_end = strstr(function, " /");
+    if (!function_end) function_end = function + strlen(function);
+    if (function_end > function) {
+      frames.push_back(std::string(function, function_end - function));
+      return true;
+    }
+  }
+
+  frames.push_back(Instrumentation::AnonymizeAddress((void *)pc_value));
+  return true;
+}
+
+bool CrashSignature::ParseSanitizerReport(const char *report, int num_frames) {
+  bug_type.clear();
+  frames.clear();
+  first_pc = 0;
+
+  if (!strstr(report, "Sanitizer")) return false;
+
+  ParseBugType(report);
+
+  // only the first stack trace is considered, later ones
+  // describe where the memory was allocated / freed
+  bool in_stack_trace = false;
+  const char *line = report;
+  while (*line && (int)frames.size() < num_frames) {
+    const char *line_end = strchr(line, '\n');
+    if (!line_end) line_end = line + strlen(line);
+
+    if (ParseFrame(line, line_end - line)) {
+      in_stack_trace = true;
+    } else if (in_stack_trace) {
+      break;
+    }
+
+    if (!*line_end) break;
+    line = line_end + 1;
+  }
+
+  return true;
+}
+
+uint32_t CrashSignature::GetStackHash() {
+  uint32_t hash = STACK_HASH_SEED;
+  for (auto iter = frames.begin(); iter != frames.end(); iter++) {
+    for (size_t i = 0; i < iter->size(); i++) {
+      hash = (hash ^ (uint8_t)(*iter)[i]) * STACK_HASH_PRIME;
+    }
+    hash = (hash ^ '\n') * STACK_HASH_PRIME;
+  }
+  return hash;
+}
+
+std::string CrashSignature::GetName(const char *prefix) {
+  std::string name = std::string(prefix) + "_" + bug_type;
+  if (frames.empty()) return name;
+
+  char hash[16];
+  sprintf(hash, "%08x", GetStackHash());
+
+  name += "_" + Instrumentation::AnonymizeAddress((void *)first_pc);
+  name += "_" + std::string(hash);
+  return name;
+}
@@ -0,0 +1,53 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+#define DEFAULT_STACK_HASH_FRAMES 3
+
+// Signature of a crash extracted from a sanitizer report.
+// Crashes with the same bug type and the same top frames
+// get the same name and are deduplicated by the fuzzer.
+class CrashSignature {
+public:
+  CrashSignature() : first_pc(0) { }
+
+  // parses the first stack trace in the report, considering
+  // at most num_frames frames. Returns false if the report
+  // doesn't contain a sanitizer error
+  bool ParseSanitizerReport(const char *report, int num_frames);
+
+  // e.g. "heap-buffer-overflow_READ" or "SEGV"
+  std::string bug_type;
+
+  // normalized frames, independent of ASLR
+  std::vector<std::string> frames;
+
+  uint64_t first_pc;
+
+  uint32_t GetStackHash();
+
+  // <sanitizer>_<bug type>_<anonymized first pc>_<stack hash>
+  std::string GetName(const char *prefix);
+
+protected:
+  void ParseBugType(const char *report);
+  bool ParseFrame(const char *line, size_t len);
+};
@@ -52,6 +52,54 @@ size_t GetFilesInDirectory(std::string directory, std::list<std::string> &list)
   return list.size();
 }
 
+DirectoryIterator::DirectoryIterator() {
+  find_handle = INVALID_HANDLE_VALUE;
+  have_find_data = false;
+}
+
+bool DirectoryIterator::Open(std::string directory) {
+  Close();
+
+  dir = directory;
+  if (dir.size() == 0) {
+    dir = DIR_SEPARATOR;
+  } else {
+    if (dir.back() != DIR_SEPARATOR) {
+      dir += DIR_SEPARATOR;
+    }
+  }
+
+  std::string search = dir + "*";
+  find_handle = FindFirstFileA(search.c_str(), &find_data);
+  if (find_handle == INVALID_HANDLE_VALUE) return false;
+  have_find_data = true;
+
+  return true;
+}
+
+bool DirectoryIterator::Next(std::string &path) {
+  while (have_find_data) {
+    std::string name = find_data.cFileName;
+    have_find_data = FindNextFileA(find_handle, &find_data);
+
+    if (name == ".") continue;
+    if (name == "..") continue;
+
+    path = dir + name;
+    return true;
+  }
+
+  return false;
+}
+
+void DirectoryIterator::Close() {
+  if (find_handle != INVALID_HANDLE_VALUE) {
+    FindClose(find_handle);
+    find_handle = INVALID_HANDLE_VALUE;
+  }
+  have_find_data = false;
+}
+
 int CreateDirectory(std::string &directory) {
   return(!_mkdir(directory.c_str()));
 }
@@ -77,6 +125,42 @@ size_t GetFilesInDirectory(std::string directory, std::list<std::string> &list)
   return list.size();
 }
 
+DirectoryIterator::DirectoryIterator() {
+  dir_handle = NULL;
+}
+
+bool DirectoryIterator::Open(std::string directory) {
+  Close();
+
+  dir = directory;
+  dir_handle = opendir(directory.c_str());
+
+  return (dir_handle != NULL);
+}
+
+bool DirectoryIterator::Next(std::string &path) {
+  if (!dir_handle) return false;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir_handle)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0) continue;
+    if (strcmp(entry->d_name, "..") == 0) continue;
+    if (strcmp(entry->d_name, ".DS_Store") == 0) continue;
+
+    path = DirJoin(dir, entry->d_name);
+    return true;
+  }
+
+  return false;
+}
+
+void DirectoryIterator::Close() {
+  if (dir_handle) {
+    closedir(dir_handle);
+    dir_handle = NULL;
+  }
+}
+
 
 int CreateDirectory(std::string &directory) {
   return(!mkdir(directory.c_str(), 0755));
@@ -84,6 +168,10 @@ int CreateDirectory(std::string &directory) {
 
 #endif
 
+DirectoryIterator::~DirectoryIterator() {
+  Close();
+}
+
 std::string DirJoin(std::string dir1, std::string dir2) {
   if (dir1.empty()) return dir2;
 
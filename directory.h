@@ -35,6 +35,31 @@ limitations under the License.
 #endif
 
 size_t GetFilesInDirectory(std::string directory, std::list<std::string> &list);
+
+// Lists the files in a directory one at a time, without reading
+// the whole listing into memory first. Files are returned in
+// the order the file system lists them
+class DirectoryIterator {
+public:
+  DirectoryIterator();
+  ~DirectoryIterator();
+
+  // returns false if the directory can't be opened
+  bool Open(std::string directory);
+  // returns false once there are no more files
+  bool Next(std::string &path);
+  void Close();
+
+protected:
+  std::string dir;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  HANDLE find_handle;
+  WIN32_FIND_DATAA find_data;
+  bool have_find_data;
+#else
+  DIR *dir_handle;
+#endif
+};
 std::string DirJoin(std::string dir1, std::string dir2);
 int CreateDirectory(std::string &directory);
 
@@ -0,0 +1,459 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "fleetstats.h"
+#include "wire.h"
+
+struct StatsField {
+  const char *name;
+  const char *metric;
+  const char *type;
+  const char *help;
+};
+
+// in the order of the fields in ClientStats and on the wire
+static const StatsField stats_fields[CLIENT_STATS_FIELDS] = {
+  { "total_execs", "jackalope_client_execs_total", "counter", "Total number of executions" },
+  { "execs_per_sec", "jackalope_client_execs_per_second", "gauge", "Current executions per second" },
+  { "num_hangs", "jackalope_client_hangs_total", "counter", "Number of hangs" },
+  { "num_crashes", "jackalope_client_crashes_total", "counter", "Number of crashes" },
+  { "num_unique_crashes", "jackalope_client_unique_crashes", "gauge", "Number of unique crashes" },
+  { "num_target_starts", "jackalope_client_target_starts_total", "counter", "Number of target process (re)starts" },
+  { "queue_size", "jackalope_client_queue_size", "gauge", "Number of samples in the fuzzing queue" },
+  { "num_samples", "jackalope_client_samples", "gauge", "Number of samples in the client corpus" },
+  { "num_offsets", "jackalope_client_offsets", "gauge", "Number of offsets covered by the client" },
+};
+
+static void GetStatsFields(ClientStats &stats, uint64_t *fields) {
+  fields[0] = stats.total_execs;
+  fields[1] = stats.execs_per_sec;
+  fields[2] = stats.num_hangs;
+  fields[3] = stats.num_crashes;
+  fields[4] = stats.num_unique_crashes;
+  fields[5] = stats.num_target_starts;
+  fields[6] = stats.queue_size;
+  fields[7] = stats.num_samples;
+  fields[8] = stats.num_offsets;
+}
+
+static void SetStatsFields(ClientStats &stats, uint64_t *fields) {
+  stats.total_execs = fields[0];
+  stats.execs_per_sec = fields[1];
+  stats.num_hangs = fields[2];
+  stats.num_crashes = fields[3];
+  stats.num_unique_crashes = fields[4];
+  stats.num_target_starts = fields[5];
+  stats.queue_size = fields[6];
+  stats.num_samples = fields[7];
+  stats.num_offsets = fields[8];
+}
+
+void EncodeClientStats(ClientStats &stats, std::string &out) {
+  uint64_t fields[CLIENT_STATS_FIELDS];
+  GetStatsFields(stats, fields);
+
+  EncodeVarint(CLIENT_STATS_FIELDS, out);
+  for (int i = 0; i < CLIENT_STATS_FIELDS; i++) {
+    EncodeVarint(fields[i], out);
+  }
+}
+
+bool DecodeClientStats(const char *data, size_t size, ClientStats &stats) {
+  const char *end = data + size;
+  uint64_t fields[CLIENT_STATS_FIELDS];
+  memset(fields, 0, sizeof(fields));
+
+  uint64_t num_fields;
+  if (!DecodeVarint(&data, end, &num_fields)) return false;
+  // each field takes at least one byte
+  if (num_fields > (uint64_t)(end - data)) return false;
+
+  for (uint64_t i = 0; i < num_fields; i++) {
+    uint64_t value;
+    if (!DecodeVarint(&data, end, &value)) return false;
+    if (i < CLIENT_STATS_FIELDS) fields[i] = value;
+  }
+
+  if (data != end) return false;
+
+  SetStatsFields(stats, fields);
+  return true;
+}
+
+static void AppendJSONField(std::string &out, const char *name, uint64_t value) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\"%s\": %llu", name, (unsigned long long)value);
+  out += buf;
+}
+
+static void AppendJSONStats(std::string &out, ClientStats &stats) {
+  uint64_t fields[CLIENT_STATS_FIELDS];
+  GetStatsFields(stats, fields);
+  for (int i = 0; i < CLIENT_STATS_FIELDS; i++) {
+    if (i) out += ", ";
+    AppendJSONField(out, stats_fields[i].name, fields[i]);
+  }
+}
+
+static void AppendMetricHeader(std::string &out, const char *metric, const char *type, const char *help) {
+  out += "# HELP ";
+  out += metric;
+  out += " ";
+  out += help;
+  out += "\n# TYPE ";
+  out += metric;
+  out += " ";
+  out += type;
+  out += "\n";
+}
+
+static void AppendMetric(std::string &out, const char *metric, const char *labels, uint64_t value) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s%s %llu\n", metric, labels, (unsigned long long)value);
+  out += buf;
+}
+
+FleetStats::FleetStats() : server_next(0), server_count(0) {
+  memset(&expired_totals, 0, sizeof(expired_totals));
+  server_history.resize(SERVER_STATS_HISTORY);
+}
+
+FleetStats::~FleetStats() {
+  for (auto iter = clients.begin(); iter != clients.end(); iter++) {
+    delete iter->second;
+  }
+}
+
+uint64_t FleetStats::ClientHistory::GetPeakExecsPerSec() {
+  uint64_t peak = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t execs_per_sec = Get(i)->stats.execs_per_sec;
+    if (execs_per_sec > peak) peak = execs_per_sec;
+  }
+  return peak;
+}
+
+void FleetStats::AddClientStats(uint64_t client_id, ClientStats &stats, bool has_rate) {
+  uint64_t cur_time = time(NULL);
+
+  mutex.Lock();
+
+  ClientHistory *history;
+  auto iter = clients.find(client_id);
+  if (iter == clients.end()) {
+    history = new ClientHistory;
+    history->next = 0;
+    history->count = 0;
+    history->first_seen = cur_time;
+    clients[client_id] = history;
+  } else {
+    history = iter->second;
+  }
+
+  ClientRecord *last = history->count ? history->GetLast() : NULL;
+  if (!has_rate) {
+    stats.execs_per_sec = 0;
+    if (last && (stats.total_execs >= last->stats.total_execs)) {
+      if (cur_time > last->time) {
+        stats.execs_per_sec = (stats.total_execs - last->stats.total_execs) / (cur_time - last->time);
+      } else {
+        stats.execs_per_sec = last->stats.execs_per_sec;
+      }
+    }
+  }
+
+  ClientRecord *record = &history->records[history->next];
+  record->time = cur_time;
+  record->stats = stats;
+  history->next = (history->next + 1) % CLIENT_STATS_HISTORY;
+  if (history->count < CLIENT_STATS_HISTORY) history->count++;
+  history->last_seen = cur_time;
+
+  mutex.Unlock();
+}
+
+void FleetStats::AddServerStats(uint64_t num_offsets, uint64_t num_samples, uint64_t num_crashes) {
+  uint64_t cur_time = time(NULL);
+
+  mutex.Lock();
+
+  ServerRecord *record = &server_history[server_next];
+  record->time = cur_time;
+  record->num_offsets = num_offsets;
+  record->num_samples = num_samples;
+  record->num_crashes = num_crashes;
+  server_next = (server_next + 1) % SERVER_STATS_HISTORY;
+  if (server_count < SERVER_STATS_HISTORY) server_count++;
+
+  ExpireClients(cur_time);
+
+  mutex.Unlock();
+}
+
+void FleetStats::ExpireClients(uint64_t cur_time) {
+  auto iter = clients.begin();
+  while (iter != clients.end()) {
+    ClientHistory *history = iter->second;
+    if (cur_time < history->last_seen + EXPIRED_CLIENT_TIMEOUT) {
+      iter++;
+      continue;
+    }
+
+    ClientStats &stats = history->GetLast()->stats;
+    expired_totals.total_execs += stats.total_execs;
+    expired_totals.num_hangs += stats.num_hangs;
+    expired_totals.num_crashes += stats.num_crashes;
+    expired_totals.num_target_starts += stats.num_target_starts;
+
+    delete history;
+    iter = clients.erase(iter);
+  }
+}
+
+bool FleetStats::IsStale(ClientHistory *history, uint64_t cur_time) {
+  return (cur_time >= history->last_seen + STALE_CLIENT_TIMEOUT);
+}
+
+bool FleetStats::IsDegraded(ClientHistory *history) {
+  if (history->count < 2) return false;
+  uint64_t execs_per_sec = history->GetLast()->stats.execs_per_sec;
+  return (execs_per_sec * 100 < history->GetPeakExecsPerSec() * DEGRADED_CLIENT_PERCENT);
+}
+
+uint64_t FleetStats::GetOffsetsPerHour() {
+  if (server_count < 2) return 0;
+
+  ServerRecord *first = &server_history[(server_next + SERVER_STATS_HISTORY - server_count) % SERVER_STATS_HISTORY];
+  ServerRecord *last = &server_history[(server_next + SERVER_STATS_HISTORY - 1) % SERVER_STATS_HISTORY];
+  if ((last->time <= first->time) || (last->num_offsets < first->num_offsets)) return 0;
+
+  return (last->num_offsets - first->num_offsets) * 3600 / (last->time - first->time);
+}
+
+void FleetStats::ComputeTotals(uint64_t cur_time, ClientStats &totals, size_t *num_active, size_t *num_stale, size_t *num_degraded) {
+  totals = expired_totals;
+  *num_active = 0;
+  *num_stale = 0;
+  *num_degraded = 0;
+
+  for (auto iter = clients.begin(); iter != clients.end(); iter++) {
+    ClientHistory *history = iter->second;
+    ClientStats &stats = history->GetLast()->stats;
+
+    totals.total_execs += stats.total_execs;
+    totals.num_hangs += stats.num_hangs;
+    totals.num_crashes += stats.num_crashes;
+    totals.num_target_starts += stats.num_target_starts;
+
+    if (IsStale(history, cur_time)) {
+      (*num_stale)++;
+      continue;
+    }
+
+    (*num_active)++;
+    if (IsDegraded(history)) (*num_degraded)++;
+
+    totals.execs_per_sec += stats.execs_per_sec;
+    totals.queue_size += stats.queue_size;
+    // clients share the corpus, so these don't add up
+    totals.num_unique_crashes = std::max(totals.num_unique_crashes, stats.num_unique_crashes);
+    totals.num_samples = std::max(totals.num_samples, stats.num_samples);
+    totals.num_offsets = std::max(totals.num_offsets, stats.num_offsets);
+  }
+}
+
+void FleetStats::GetFleetTotals(ClientStats &totals, size_t *num_active, size_t *num_stale) {
+  size_t num_degraded;
+  mutex.Lock();
+  ComputeTotals(time(NULL), totals, num_active, num_stale, &num_degraded);
+  mutex.Unlock();
+}
+
+void FleetStats::GetSortedClients(std::vector<uint64_t> &client_ids) {
+  for (auto iter = clients.begin(); iter != clients.end(); iter++) {
+    client_ids.push_back(iter->first);
+  }
+  std::sort(client_ids.begin(), client_ids.end());
+}
+
+void FleetStats::GetJSON(std::string &out) {
+  uint64_t cur_time = time(NULL);
+  char buf[64];
+
+  mutex.Lock();
+
+  ClientStats totals;
+  size_t num_active, num_stale, num_degraded;
+  ComputeTotals(cur_time, totals, &num_active, &num_stale, &num_degraded);
+
+  out += "{\n";
+  out += "  ";
+  AppendJSONField(out, "time", cur_time);
+  out += ",\n";
+
+  out += "  \"server\": {";
+  if (server_count) {
+    ServerRecord *last = &server_history[(server_next + SERVER_STATS_HISTORY - 1) % SERVER_STATS_HISTORY];
+    AppendJSONField(out, "num_offsets", last->num_offsets);
+    out += ", ";
+    AppendJSONField(out, "num_samples", last->num_samples);
+    out += ", ";
+    AppendJSONField(out, "num_crashes", last->num_crashes);
+    out += ", ";
+  }
+  AppendJSONField(out, "offsets_per_hour", GetOffsetsPerHour());
+  out += ",\n    \"history\": [";
+  for (size_t i = 0; i < server_count; i++) {
+    ServerRecord *record = &server_history[(server_next + SERVER_STATS_HISTORY - server_count + i) % SERVER_STATS_HISTORY];
+    out += i ? ",\n      { " : "\n      { ";
+    AppendJSONField(out, "time", record->time);
+    out += ", ";
+    AppendJSONField(out, "num_offsets", record->num_offsets);
+    out += ", ";
+    AppendJSONField(out, "num_samples", record->num_samples);
+    out += ", ";
+    AppendJSONField(out, "num_crashes", record->num_crashes);
+    out += " }";
+  }
+  out += "]\n  },\n";
+
+  out += "  \"fleet\": { ";
+  AppendJSONField(out, "num_active", num_active);
+  out += ", ";
+  AppendJSONField(out, "num_stale", num_stale);
+  out += ", ";
+  AppendJSONField(out, "num_degraded", num_degraded);
+  out += ", ";
+  AppendJSONStats(out, totals);
+  out += " },\n";
+
+  out += "  \"clients\": [";
+  std::vector<uint64_t> client_ids;
+  GetSortedClients(client_ids);
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    ClientHistory *history = clients[client_ids[i]];
+
+    out += i ? ",\n    {\n" : "\n    {\n";
+    snprintf(buf, sizeof(buf), "      \"id\": \"%016llx\",\n", (unsigned long long)client_ids[i]);
+    out += buf;
+    out += "      ";
+    AppendJSONField(out, "first_seen", history->first_seen);
+    out += ", ";
+    AppendJSONField(out, "last_seen", history->last_seen);
+    out += ", ";
+    AppendJSONField(out, "peak_execs_per_sec", history->GetPeakExecsPerSec());
+    out += ",\n";
+    out += IsStale(history, cur_time) ? "      \"stale\": true, " : "      \"stale\": false, ";
+    out += IsDegraded(history) ? "\"degraded\": true,\n" : "\"degraded\": false,\n";
+    out += "      \"stats\": { ";
+    AppendJSONStats(out, history->GetLast()->stats);
+    out += " },\n";
+    out += "      \"history\": [";
+    for (size_t j = 0; j < history->count; j++) {
+      ClientRecord *record = history->Get(j);
+      out += j ? ",\n        { " : "\n        { ";
+      AppendJSONField(out, "time", record->time);
+      out += ", ";
+      AppendJSONStats(out, record->stats);
+      out += " }";
+    }
+    out += "]\n    }";
+  }
+  out += "]\n}\n";
+
+  mutex.Unlock();
+}
+
+void FleetStats::GetPrometheus(std::string &out) {
+  uint64_t cur_time = time(NULL);
+
+  mutex.Lock();
+
+  ClientStats totals;
+  size_t num_active, num_stale, num_degraded;
+  ComputeTotals(cur_time, totals, &num_active, &num_stale, &num_degraded);
+
+  std::vector<uint64_t> client_ids;
+  GetSortedClients(client_ids);
+
+  std::vector<std::string> labels;
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{client=\"%016llx\"}", (unsigned long long)client_ids[i]);
+    labels.push_back(buf);
+  }
+
+  for (int f = 0; f < CLIENT_STATS_FIELDS; f++) {
+    AppendMetricHeader(out, stats_fields[f].metric, stats_fields[f].type, stats_fields[f].help);
+    for (size_t i = 0; i < client_ids.size(); i++) {
+      uint64_t fields[CLIENT_STATS_FIELDS];
+      GetStatsFields(clients[client_ids[i]]->GetLast()->stats, fields);
+      AppendMetric(out, stats_fields[f].metric, labels[i].c_str(), fields[f]);
+    }
+  }
+
+  AppendMetricHeader(out, "jackalope_client_last_seen_seconds", "gauge", "Unix time of the last sync with the client");
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    AppendMetric(out, "jackalope_client_last_seen_seconds", labels[i].c_str(), clients[client_ids[i]]->last_seen);
+  }
+
+  AppendMetricHeader(out, "jackalope_client_stale", "gauge", "1 if the client hasn't synced recently");
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    AppendMetric(out, "jackalope_client_stale", labels[i].c_str(), IsStale(clients[client_ids[i]], cur_time) ? 1 : 0);
+  }
+
+  AppendMetricHeader(out, "jackalope_client_degraded", "gauge", "1 if the client's exec/s dropped well below its recent peak");
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    AppendMetric(out, "jackalope_client_degraded", labels[i].c_str(), IsDegraded(clients[client_ids[i]]) ? 1 : 0);
+  }
+
+  AppendMetricHeader(out, "jackalope_fleet_clients", "gauge", "Number of known clients");
+  AppendMetric(out, "jackalope_fleet_clients", "{state=\"active\"}", num_active);
+  AppendMetric(out, "jackalope_fleet_clients", "{state=\"stale\"}", num_stale);
+  AppendMetric(out, "jackalope_fleet_clients", "{state=\"degraded\"}", num_degraded);
+
+  AppendMetricHeader(out, "jackalope_fleet_execs_total", "counter", "Total number of executions of all clients");
+  AppendMetric(out, "jackalope_fleet_execs_total", "", totals.total_execs);
+
+  AppendMetricHeader(out, "jackalope_fleet_execs_per_second", "gauge", "Executions per second of the active clients");
+  AppendMetric(out, "jackalope_fleet_execs_per_second", "", totals.execs_per_sec);
+
+  if (server_count) {
+    ServerRecord *last = &server_history[(server_next + SERVER_STATS_HISTORY - 1) % SERVER_STATS_HISTORY];
+
+    AppendMetricHeader(out, "jackalope_server_offsets", "gauge", "Number of offsets covered by all clients");
+    AppendMetric(out, "jackalope_server_offsets", "", last->num_offsets);
+
+    AppendMetricHeader(out, "jackalope_server_samples", "gauge", "Number of samples in the server corpus");
+    AppendMetric(out, "jackalope_server_samples", "", last->num_samples);
+
+    AppendMetricHeader(out, "jackalope_server_crashes_total", "counter", "Number of crashes reported to the server");
+    AppendMetric(out, "jackalope_server_crashes_total", "", last->num_crashes);
+  }
+
+  AppendMetricHeader(out, "jackalope_server_offsets_per_hour", "gauge", "Coverage growth over the last hour");
+  AppendMetric(out, "jackalope_server_offsets_per_hour", "", GetOffsetsPerHour());
+
+  mutex.Unlock();
+}
@@ -0,0 +1,135 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#pragma once
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "mutex.h"
+
+// Statistics a client sends to the server with each update request
+struct ClientStats {
+  uint64_t total_execs;
+  uint64_t execs_per_sec;
+  uint64_t num_hangs;
+  uint64_t num_crashes;
+  uint64_t num_unique_crashes;
+  // how many times target processes were (re)started
+  uint64_t num_target_starts;
+  uint64_t queue_size;
+  uint64_t num_samples;
+  uint64_t num_offsets;
+};
+
+#define CLIENT_STATS_FIELDS 9
+
+// The stats are encoded as the number of fields followed by the
+// fields as varints. Fields can be added at the end: decoding
+// ignores fields it doesn't know about and zeroes missing ones
+void EncodeClientStats(ClientStats &stats, std::string &out);
+bool DecodeClientStats(const char *data, size_t size, ClientStats &stats);
+
+// number of stats records kept per client
+#define CLIENT_STATS_HISTORY 64
+
+// number of server records kept, one is added every 10 seconds
+#define SERVER_STATS_HISTORY 360
+
+// clients that haven't synced for this long (in seconds) are stale
+#define STALE_CLIENT_TIMEOUT (15 * 60)
+
+// stale clients are forgotten after this long (in seconds)
+#define EXPIRED_CLIENT_TIMEOUT (24 * 60 * 60)
+
+// clients whose current exec/s is below this percentage of
+// the best exec/s in their history are reported as degraded
+#define DEGRADED_CLIENT_PERCENT 50
+
+// Live statistics of all clients connected to a server, kept as a
+// ring-buffered time series per client, and of the server itself.
+// Served as JSON or Prometheus text on the admin port
+class FleetStats {
+public:
+  FleetStats();
+  ~FleetStats();
+
+  // has_rate is false for clients that only report total execs,
+  // in which case the exec/s is computed from the previous record
+  void AddClientStats(uint64_t client_id, ClientStats &stats, bool has_rate);
+
+  void AddServerStats(uint64_t num_offsets, uint64_t num_samples, uint64_t num_crashes);
+
+  // counters are summed over all clients, including the ones that are
+  // gone, while exec/s and queue sizes only over the active clients
+  void GetFleetTotals(ClientStats &totals, size_t *num_active, size_t *num_stale);
+
+  void GetJSON(std::string &out);
+  void GetPrometheus(std::string &out);
+
+protected:
+  struct ClientRecord {
+    // unix time
+    uint64_t time;
+    ClientStats stats;
+  };
+
+  struct ClientHistory {
+    ClientRecord records[CLIENT_STATS_HISTORY];
+    // ring buffer, oldest record is at
+    // (next + CLIENT_STATS_HISTORY - count) % CLIENT_STATS_HISTORY
+    size_t next;
+    size_t count;
+    uint64_t first_seen;
+    uint64_t last_seen;
+
+    ClientRecord *GetLast() {
+      return &records[(next + CLIENT_STATS_HISTORY - 1) % CLIENT_STATS_HISTORY];
+    }
+    ClientRecord *Get(size_t i) {
+      return &records[(next + CLIENT_STATS_HISTORY - count + i) % CLIENT_STATS_HISTORY];
+    }
+    uint64_t GetPeakExecsPerSec();
+  };
+
+  struct ServerRecord {
+    uint64_t time;
+    uint64_t num_offsets;
+    uint64_t num_samples;
+    uint64_t num_crashes;
+  };
+
+  // all of these require the mutex
+  void ExpireClients(uint64_t cur_time);
+  bool IsStale(ClientHistory *history, uint64_t cur_time);
+  bool IsDegraded(ClientHistory *history);
+  uint64_t GetOffsetsPerHour();
+  void ComputeTotals(uint64_t cur_time, ClientStats &totals, size_t *num_active, size_t *num_stale, size_t *num_degraded);
+  void GetSortedClients(std::vector<uint64_t> &client_ids);
+
+  Mutex mutex;
+
+  std::unordered_map<uint64_t, ClientHistory *> clients;
+  // counters of expired clients, so that the totals don't decrease
+  ClientStats expired_totals;
+
+  std::vector<ServerRecord> server_history;
+  size_t server_next;
+  size_t server_count;
+};
@@ -18,6 +18,7 @@ limitations under the License.
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include "common.h"
 #include "sample.h"
 #include "fuzzer.h"
@@ -28,6 +29,8 @@ limitations under the License.
 #include "thread.h"
 #include "directory.h"
 #include "client.h"
+#include "localsync.h"
+#include "corpusindex.h"
 #include "mersenne.h"
 
 using namespace std;
@@ -40,6 +43,8 @@ void Fuzzer::PrintUsage() {
 void Fuzzer::ParseOptions(int argc, char **argv) {
   int server_update_interval = GetIntOption("-server_update_interval", argc, argv, 5 * 60);
   server_update_interval_ms = server_update_interval * 1000;
+  int server_report_interval = GetIntOption("-server_report_interval", argc, argv, DEFAULT_SERVER_REPORT_INTERVAL);
+  server_report_interval_ms = server_report_interval * 1000;
 
   acceptable_hang_ratio = 0.01;
   acceptable_crash_ratio = 0.02;
@@ -57,6 +62,9 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
   option = GetOption("-out", argc, argv);
   if (!option) PrintUsage();
   this->out_dir = option;
+
+  option = GetOption("-cmin", argc, argv);
+  if (option) cmin_dir = option;
   
   option = GetOption("-delivery_dir", argc, argv);
   if (!option) {
@@ -90,12 +98,25 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
   
   corpus_timeout = GetIntOption("-t_corpus", argc, argv, timeout);
 
+  max_timeout = timeout;
+  adaptive_timeout = GetBinaryOption("-adaptive_timeout", argc, argv, false);
+
   if (GetOption("-server", argc, argv)) {
     server = new CoverageClient();
     server->Init(argc, argv);
   } else {
     server = NULL;
   }
+
+  char *local_sync_name = GetOption("-local_sync", argc, argv);
+  if (local_sync_name) {
+    size_t local_sync_size = (size_t)GetIntOption("-local_sync_size", argc, argv, DEFAULT_LOCAL_SYNC_SIZE);
+    local_sync = new LocalSync();
+    local_sync->Init(local_sync_name, local_sync_size * 1024 * 1024);
+  } else {
+    local_sync = NULL;
+  }
+  local_sync_samples_pending = false;
   
   should_restore_state = false;
   if((in_dir == "-") ||
@@ -108,6 +129,10 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
   clean_target_on_coverage = GetBinaryOption("-clean_target_on_coverage", argc, argv, true);
   coverage_reproduce_retries = GetIntOption("-coverage_retry", argc, argv, DEFAULT_COVERAGE_REPRODUCE_RETRIES);
   crash_reproduce_retries = GetIntOption("-crash_retry", argc, argv, DEFAULT_CRASH_REPRODUCE_RETRIES);
+  num_triage_threads = GetIntOption("-triage_threads", argc, argv, DEFAULT_TRIAGE_THREADS);
+  num_minimize_threads = GetIntOption("-minimize_threads", argc, argv, DEFAULT_MINIMIZE_THREADS);
+  num_input_loader_threads = GetIntOption("-input_loader_threads", argc, argv, DEFAULT_INPUT_LOADER_THREADS);
+  if (num_input_loader_threads < 1) num_input_loader_threads = 1;
 
   minimize_samples = GetBinaryOption("-minimize_samples", argc, argv, true);
 
@@ -120,6 +145,8 @@ void Fuzzer::ParseOptions(int argc, char **argv) {
   dry_run = GetBinaryOption("-dry_run", argc, argv, false);
   
   incremental_coverage = GetBinaryOption("-incremental_coverage", argc, argv, true);
+
+  propagate_coverage = GetBinaryOption("-propagate_coverage", argc, argv, true);
   
   add_all_inputs = GetBinaryOption("-add_all_inputs", argc, argv, false);
   
@@ -145,6 +172,48 @@ void *StartFuzzThread(void *arg) {
   return NULL;
 }
 
+void *StartTriageThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunTriageThread(tc);
+  return NULL;
+}
+
+void *StartMinimizeThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunMinimizeThread(tc);
+  return NULL;
+}
+
+void *StartCminThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunCminThread(tc);
+  return NULL;
+}
+
+void *StartInputLoaderThread(void *arg) {
+  Fuzzer *fuzzer = (Fuzzer *)arg;
+  fuzzer->RunInputLoaderThread();
+  return NULL;
+}
+
+void *StartRestoreThread(void *arg) {
+  Fuzzer::ThreadContext *tc = (Fuzzer::ThreadContext*)arg;
+  tc->fuzzer->RunRestoreThread(tc);
+  return NULL;
+}
+
+void *StartServerSyncThread(void *arg) {
+  Fuzzer *fuzzer = (Fuzzer *)arg;
+  fuzzer->RunServerSyncThread();
+  return NULL;
+}
+
+void *StartLocalSyncThread(void *arg) {
+  Fuzzer *fuzzer = (Fuzzer *)arg;
+  fuzzer->RunLocalSyncThread();
+  return NULL;
+}
+
 Fuzzer::ThreadContext::~ThreadContext() {
   if (sampleDelivery) delete sampleDelivery;
   if (prng) delete prng;
@@ -173,31 +242,109 @@ void Fuzzer::Run(int argc, char **argv) {
   num_samples = 0;
   num_samples_discarded = 0;
   total_execs = 0;
+  crash_handling_time = 0;
+  num_target_starts = 0;
+  num_retries_saved = 0;
+  num_propagated_offsets = 0;
+  num_stable_edges = 0;
+  num_flaky_edges = 0;
+  coverage_updates_base = 0;
+  coverage_epoch = 0;
+  cur_execs_per_sec = 0;
+  cur_num_offsets = 0;
+  crashes_pending_triage = 0;
+  input_loaders_running = 0;
+  restore_fp = NULL;
+  restore_started = false;
+  next_restore_entry = 0;
+  entries_pending_restore = 0;
+  num_inputs_read = 0;
+  num_input_duplicates = 0;
+  samples_pending_minimization = 0;
+  num_samples_minimized = 0;
+  num_bytes_minimized = 0;
+  initial_server_sync_pending = false;
 
   ParseOptions(argc, argv);
 
   SetupDirectories();
 
+  if (!cmin_dir.empty()) {
+    MinimizeCorpus(argc, argv);
+    return;
+  }
+
   if(should_restore_state) {
     state = RESTORE_NEEDED;
   } else {
-    GetFilesInDirectory(in_dir, input_files);
-
-    if (input_files.size() == 0) {
-      WARN("Input directory is empty\n");
-    } else {
-      SAY("%d input files read\n", (int)input_files.size());
+    if (!input_dir_iterator.Open(in_dir)) {
+      WARN("Error opening input directory %s\n", in_dir.c_str());
+    }
+    input_loaders_running = num_input_loader_threads;
+    for (int i = 0; i < num_input_loader_threads; i++) {
+      CreateThread(StartInputLoaderThread, this);
     }
     state = INPUT_SAMPLE_PROCESSING;
   }
   
   last_save_time = GetCurTime();
   
+  corpus_view = new CorpusView();
+  corpus_view.load()->epoch = 0;
+  corpus_epoch = 0;
+  corpus_view_dirty = false;
+
+  // all fuzzing threads need to be known before
+  // any of them starts reclaiming corpus views
   for (int i = 1; i <= num_threads; i++) {
-    ThreadContext *tc = CreateThreadContext(argc, argv, i);
+    corpus_readers.push_back(CreateThreadContext(argc, argv, i));
+  }
+  for (ThreadContext *tc : corpus_readers) {
     CreateThread(StartFuzzThread, tc);
   }
 
+  // triage threads get ids after the fuzzing threads
+  // so that they don't share delivery files / shared memory
+  for (int i = 1; i <= num_triage_threads; i++) {
+    ThreadContext *tc = CreateThreadContext(argc, argv, (int)num_threads + i);
+    CreateThread(StartTriageThread, tc);
+  }
+
+  // followed by the minimization threads
+  if (minimize_samples) {
+    for (int i = 1; i <= num_minimize_threads; i++) {
+      ThreadContext *tc = CreateThreadContext(argc, argv, (int)num_threads + num_triage_threads + i);
+      CreateThread(StartMinimizeThread, tc);
+    }
+  }
+
+  if (server) {
+    CreateThread(StartServerSyncThread, this);
+  }
+
+  if (local_sync) {
+    CreateThread(StartLocalSyncThread, this);
+  }
+
+  // restore threads only need a mutator
+  // to recreate the sample contexts
+  if (should_restore_state) {
+    for (int i = 1; i <= num_input_loader_threads; i++) {
+      ThreadContext *tc = new ThreadContext();
+      tc->thread_id = (int)num_threads + num_triage_threads + num_minimize_threads + i;
+      tc->fuzzer = this;
+      tc->sampleDelivery = NULL;
+      tc->instrumentation = NULL;
+      tc->minimizer = NULL;
+      tc->range_tracker = NULL;
+      tc->target_argc = 0;
+      tc->target_argv = NULL;
+      tc->prng = CreatePRNG(argc, argv, tc);
+      tc->mutator = CreateMutator(argc, argv, tc);
+      CreateThread(StartRestoreThread, tc);
+    }
+  }
+
   uint64_t last_execs = 0;
   
   uint32_t secs_to_sleep = 1;
@@ -216,10 +363,25 @@ void Fuzzer::Run(int argc, char **argv) {
     }
     coverage_mutex.Unlock();
     
-    printf("\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nOffsets: %zu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, num_offsets, (total_execs - last_execs) / secs_to_sleep);
+    cur_execs_per_sec = (total_execs - last_execs) / secs_to_sleep;
+    cur_num_offsets = num_offsets;
+
+    printf("\nTotal execs: %lld\nUnique samples: %lld (%lld discarded)\nCrashes: %lld (%lld unique)\nHangs: %lld\nCrash handling time: %lld ms\nOffsets: %zu\nExecs/s: %lld\n", total_execs, num_samples, num_samples_discarded, num_crashes, num_unique_crashes, num_hangs, crash_handling_time / 1000, num_offsets, cur_execs_per_sec);
     last_execs = total_execs;
+
+    if (incremental_coverage && propagate_coverage) {
+      printf("Coverage retries saved: %lld execs (%lld offsets propagated between threads)\n", num_retries_saved, num_propagated_offsets);
+    } else {
+      printf("Coverage retries saved: %lld execs\n", num_retries_saved);
+    }
+    if (num_stable_edges + num_flaky_edges) {
+      printf("Edge stability: %.2f%% (%zu flaky edges)\n", 100.0 * num_stable_edges / (num_stable_edges + num_flaky_edges), num_flaky_edges);
+    }
+    if (num_samples_minimized || samples_pending_minimization) {
+      printf("Minimized samples: %lld (%lld bytes removed, %zu pending)\n", num_samples_minimized, num_bytes_minimized, samples_pending_minimization);
+    }
     
-    if (state == FUZZING && dry_run) {
+    if (state == FUZZING && dry_run && !crashes_pending_triage) {
       printf("\nDry run done\n");
       exit(0);
     }
@@ -259,56 +421,46 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
     }
   }
 
+  uint64_t run_start = GetCurTime();
   RunResult result = tc->instrumentation->Run(tc->target_argc, tc->target_argv, init_timeout, timeout);
-  tc->instrumentation->GetCoverage(*coverage, true);
 
-  // save crashes and hangs immediately when they are detected
-  if (result == CRASH) {
-    string crash_desc = tc->instrumentation->GetCrashName();
-    
-    if (crash_reproduce_retries > 0) {
-        if (TryReproduceCrash(tc, sample, init_timeout, timeout) == CRASH) {
-            // get a hopefully better name
-            crash_desc = tc->instrumentation->GetCrashName();
-        } else {
-            crash_desc = "flaky_" + crash_desc;
-        }
-    }
-    
-    bool should_save_crash = false;
-    int duplicates = 0;
-    
-    crash_mutex.Lock();
-    num_crashes++;
+  // not protected by a mutex, same as total_execs
+  num_target_starts += tc->instrumentation->GetNumTargetStarts();
+  if (result != OK) {
+    crash_handling_time += tc->instrumentation->GetCrashHandlingTime();
+  }
 
-    auto crash_it = unique_crashes.find(crash_desc);
-    if(crash_it == unique_crashes.end()) {
-      should_save_crash = true;
-      duplicates = 1;
-      unique_crashes[crash_desc] = 1;
-      num_unique_crashes++;
-    } else {
-      if(crash_it->second < MAX_IDENTICAL_CRASHES) {
-        should_save_crash = true;
-        crash_it->second++;
-        duplicates = crash_it->second;
+  uint32_t confirm_timeout = GetHangConfirmTimeout(timeout);
+  if ((result == HANG) && (confirm_timeout > timeout)) {
+    // the timeout might just be too tight for this sample,
+    // only count the hang if it reproduces with a longer timeout
+    tc->instrumentation->ClearCoverage();
+    if (tc->sampleDelivery->DeliverSample(sample)) {
+      total_execs++;
+      run_start = GetCurTime();
+      result = tc->instrumentation->Run(tc->target_argc, tc->target_argv, init_timeout, confirm_timeout);
+      num_target_starts += tc->instrumentation->GetNumTargetStarts();
+      if (result != OK) {
+        crash_handling_time += tc->instrumentation->GetCrashHandlingTime();
       }
     }
-    crash_mutex.Unlock();
+  }
 
-    if(should_save_crash) {
-      string crash_filename = crash_desc + "_" + std::to_string(duplicates);
-      
-      output_mutex.Lock();
-      string outfile = DirJoin(crash_dir, crash_filename);
-      sample->Save(outfile.c_str());
-      output_mutex.Unlock();
+  tc->last_exec_time = GetCurTime() - run_start;
+  tc->instrumentation->GetCoverage(*coverage, true);
 
-      if (server) {
-        server_mutex.Lock();
-        server->ReportCrash(sample, crash_desc);
-        server_mutex.Unlock();
-      }
+  if (adaptive_timeout && (result == OK) && (state == INPUT_SAMPLE_PROCESSING)) {
+    exec_times_mutex.Lock();
+    exec_times.push_back(tc->last_exec_time);
+    exec_times_mutex.Unlock();
+  }
+
+  // save crashes and hangs immediately when they are detected
+  if (result == CRASH) {
+    string crash_desc = tc->instrumentation->GetCrashName();
+
+    if (!QueueCrashForTriage(sample, crash_desc, init_timeout, timeout)) {
+      TriageCrash(tc, sample, crash_desc, init_timeout, timeout);
     }
   }
 
@@ -325,6 +477,419 @@ RunResult Fuzzer::RunSampleAndGetCoverage(ThreadContext *tc, Sample *sample, Cov
   return result;
 }
 
+bool Fuzzer::QueueCrashForTriage(Sample *sample, std::string &crash_desc, uint32_t init_timeout, uint32_t timeout) {
+  if (!num_triage_threads) return false;
+
+  triage_mutex.Lock();
+  if (triage_queue.size() >= MAX_TRIAGE_QUEUE_SIZE) {
+    triage_mutex.Unlock();
+    return false;
+  }
+  triage_queue.push_back({ new Sample(*sample), crash_desc, init_timeout, timeout });
+  crashes_pending_triage++;
+  triage_mutex.Unlock();
+
+  return true;
+}
+
+void Fuzzer::TriageCrash(ThreadContext *tc, Sample *sample, std::string crash_desc, uint32_t init_timeout, uint32_t timeout) {
+  if (crash_reproduce_retries > 0) {
+      if (TryReproduceCrash(tc, sample, init_timeout, timeout) == CRASH) {
+          // get a hopefully better name
+          crash_desc = tc->instrumentation->GetCrashName();
+      } else {
+          crash_desc = "flaky_" + crash_desc;
+      }
+  }
+  
+  bool should_save_crash = false;
+  int duplicates = 0;
+  
+  crash_mutex.Lock();
+  num_crashes++;
+
+  auto crash_it = unique_crashes.find(crash_desc);
+  if(crash_it == unique_crashes.end()) {
+    should_save_crash = true;
+    duplicates = 1;
+    unique_crashes[crash_desc] = 1;
+    num_unique_crashes++;
+  } else {
+    if(crash_it->second < MAX_IDENTICAL_CRASHES) {
+      should_save_crash = true;
+      crash_it->second++;
+      duplicates = crash_it->second;
+    }
+  }
+  crash_mutex.Unlock();
+
+  if(should_save_crash) {
+    string crash_filename = crash_desc + "_" + std::to_string(duplicates);
+    
+    output_mutex.Lock();
+    string outfile = DirJoin(crash_dir, crash_filename);
+    sample->Save(outfile.c_str());
+    output_mutex.Unlock();
+
+    if (server) QueueCrashReport(sample, crash_desc);
+  }
+}
+
+void Fuzzer::RunTriageThread(ThreadContext *tc) {
+  while (1) {
+    triage_mutex.Lock();
+    if (triage_queue.empty()) {
+      triage_mutex.Unlock();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(TRIAGE_POLL_INTERVAL);
+#else
+      usleep(TRIAGE_POLL_INTERVAL * 1000);
+#endif
+      continue;
+    }
+    CrashTriageJob job = triage_queue.front();
+    triage_queue.pop_front();
+    triage_mutex.Unlock();
+
+    TriageCrash(tc, job.sample, job.crash_desc, job.init_timeout, job.timeout);
+    delete job.sample;
+
+    triage_mutex.Lock();
+    crashes_pending_triage--;
+    triage_mutex.Unlock();
+  }
+}
+
+void Fuzzer::RunInputLoaderThread() {
+  while (1) {
+    std::string filename;
+
+    input_mutex.Lock();
+    bool have_file = input_dir_iterator.Next(filename);
+    input_mutex.Unlock();
+
+    if (!have_file) break;
+
+    Sample *sample = new Sample();
+    if (!sample->Load(filename.c_str())) {
+      WARN("Error reading input sample %s", filename.c_str());
+      delete sample;
+      continue;
+    }
+    if (sample->size > Sample::max_size) {
+      WARN("Input sample larger than maximum sample size. Will be trimmed");
+      sample->Trim(Sample::max_size);
+    }
+
+    uint64_t hash = sample->GetHash();
+
+    input_mutex.Lock();
+    num_inputs_read++;
+    if (input_hashes.find(hash) != input_hashes.end()) {
+      num_input_duplicates++;
+      input_mutex.Unlock();
+      delete sample;
+      continue;
+    }
+    input_hashes.insert(hash);
+
+    while (input_samples.size() >= MAX_PREFETCHED_INPUTS) {
+      input_mutex.Unlock();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(INPUT_LOADER_POLL_INTERVAL);
+#else
+      usleep(INPUT_LOADER_POLL_INTERVAL * 1000);
+#endif
+      input_mutex.Lock();
+    }
+    input_samples.push_back({ filename, sample });
+    input_mutex.Unlock();
+  }
+
+  input_mutex.Lock();
+  input_loaders_running--;
+  if (!input_loaders_running) {
+    if (!num_inputs_read) {
+      WARN("Input directory is empty\n");
+    } else {
+      SAY("%zu input files read (%zu duplicates skipped)\n", num_inputs_read, num_input_duplicates);
+    }
+    // only needed for deduplication
+    input_hashes.clear();
+  }
+  input_mutex.Unlock();
+}
+
+bool Fuzzer::InputLoadingDone() {
+  input_mutex.Lock();
+  bool ret = !input_loaders_running && input_samples.empty();
+  input_mutex.Unlock();
+  return ret;
+}
+
+void Fuzzer::MinimizeCorpus(int argc, char **argv) {
+  std::list<std::string> files;
+  GetFilesInDirectory(in_dir, files);
+  if (files.empty()) FATAL("Input directory is empty\n");
+  cmin_files.assign(files.begin(), files.end());
+  files.clear();
+
+  SAY("Minimizing corpus of %zu samples\n", cmin_files.size());
+
+  corpus_index = new CorpusIndex();
+  string index_filename = DirJoin(out_dir, "cmin_index.dat");
+  corpus_index->Init(index_filename);
+
+  cmin_next_file = 0;
+  cmin_files_done = 0;
+  cmin_files_skipped = 0;
+
+  // crashes in the corpus are saved to the crash directory
+  // by the thread that found them
+  num_triage_threads = 0;
+  state = INPUT_SAMPLE_PROCESSING;
+
+  for (int i = 1; i <= num_threads; i++) {
+    ThreadContext *tc = CreateThreadContext(argc, argv, i);
+    CreateThread(StartCminThread, tc);
+  }
+
+  while (1) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(1000);
+#else
+    usleep(1000000);
+#endif
+    queue_mutex.Lock();
+    size_t files_done = cmin_files_done;
+    size_t files_skipped = cmin_files_skipped;
+    queue_mutex.Unlock();
+
+    printf("Indexed %zu/%zu samples (%zu skipped), %zu offsets\n", files_done, cmin_files.size(), files_skipped, corpus_index->GetNumEdges());
+
+    if (files_done == cmin_files.size()) break;
+  }
+
+  std::vector<size_t> selected;
+  corpus_index->Solve(selected);
+
+  CreateDirectory(cmin_dir);
+
+  uint64_t total_size = 0;
+  for (size_t i = 0; i < selected.size(); i++) {
+    string &filename = cmin_files[selected[i]];
+    size_t name_start = filename.find_last_of("/\\");
+    name_start = (name_start == string::npos) ? 0 : name_start + 1;
+
+    Sample sample;
+    if (!sample.Load(filename.c_str())) {
+      FATAL("Error reading %s", filename.c_str());
+    }
+    string outfile = DirJoin(cmin_dir, filename.substr(name_start));
+    sample.Save(outfile.c_str());
+    total_size += sample.size;
+  }
+
+  printf("\nSelected %zu of %zu samples (%llu bytes) covering %zu offsets\n", selected.size(), corpus_index->GetNumSamples(), total_size, corpus_index->GetNumEdges());
+  printf("Crashes: %lld (%lld unique)\nHangs: %lld\n", num_crashes, num_unique_crashes, num_hangs);
+
+  delete corpus_index;
+  corpus_index = NULL;
+}
+
+void Fuzzer::RunCminThread(ThreadContext *tc) {
+  while (1) {
+    queue_mutex.Lock();
+    if (cmin_next_file >= cmin_files.size()) {
+      queue_mutex.Unlock();
+      break;
+    }
+    size_t sample_id = cmin_next_file++;
+    string filename = cmin_files[sample_id];
+    queue_mutex.Unlock();
+
+    // samples are loaded one at a time
+    // and only the coverage is kept
+    bool indexed = false;
+    Sample sample;
+    if (!sample.Load(filename.c_str())) {
+      WARN("Error reading %s", filename.c_str());
+    } else if (sample.size > Sample::max_size) {
+      WARN("Sample %s larger than maximum sample size, skipping", filename.c_str());
+    } else {
+      Coverage coverage;
+      RunResult result = RunSampleAndGetCoverage(tc, &sample, &coverage, init_timeout, corpus_timeout);
+      if ((result == OK) && !coverage.empty()) {
+        corpus_index->AddSample(sample_id, sample.size, tc->last_exec_time, coverage);
+        indexed = true;
+      }
+    }
+
+    queue_mutex.Lock();
+    cmin_files_done++;
+    if (!indexed) cmin_files_skipped++;
+    queue_mutex.Unlock();
+  }
+}
+
+void Fuzzer::QueueCoverageReport(Coverage *coverage, Sample *sample) {
+  server_queue_mutex.Lock();
+  if (sample) {
+    server_coverage_reports.push_back({ *coverage, new Sample(*sample) });
+    if (server_coverage_reports.size() > MAX_PENDING_SERVER_REPORTS) {
+      ServerCoverageReport &oldest = server_coverage_reports.front();
+      MergeCoverage(server_variable_coverage, oldest.coverage);
+      delete oldest.sample;
+      server_coverage_reports.pop_front();
+    }
+  } else {
+    MergeCoverage(server_variable_coverage, *coverage);
+  }
+  server_queue_mutex.Unlock();
+}
+
+void Fuzzer::QueueCrashReport(Sample *sample, std::string &crash_desc) {
+  server_queue_mutex.Lock();
+  server_crash_reports.push_back({ new Sample(*sample), crash_desc });
+  if (server_crash_reports.size() > MAX_PENDING_SERVER_REPORTS) {
+    delete server_crash_reports.front().first;
+    server_crash_reports.pop_front();
+  }
+  server_queue_mutex.Unlock();
+}
+
+void Fuzzer::FlushServerReports() {
+  std::list<ServerCoverageReport> coverage_reports;
+  Coverage variable_coverage;
+  std::list<std::pair<Sample *, std::string>> crash_reports;
+
+  server_queue_mutex.Lock();
+  coverage_reports.swap(server_coverage_reports);
+  variable_coverage.swap(server_variable_coverage);
+  crash_reports.swap(server_crash_reports);
+  server_queue_mutex.Unlock();
+
+  if (coverage_reports.empty() && variable_coverage.empty() && crash_reports.empty()) {
+    return;
+  }
+
+  // all reports go over the same connection. Samples are
+  // reported one by one as the server only accepts a sample
+  // if the coverage reported along with it is new
+  server_mutex.Lock();
+  for (auto iter = coverage_reports.begin(); iter != coverage_reports.end(); iter++) {
+    server->ReportNewCoverage(&iter->coverage, iter->sample);
+  }
+  if (!variable_coverage.empty()) {
+    server->ReportNewCoverage(&variable_coverage, NULL);
+  }
+  if (!crash_reports.empty()) {
+    server->ReportCrashes(crash_reports);
+  }
+  server_mutex.Unlock();
+
+  for (auto iter = coverage_reports.begin(); iter != coverage_reports.end(); iter++) {
+    delete iter->sample;
+  }
+  for (auto iter = crash_reports.begin(); iter != crash_reports.end(); iter++) {
+    delete iter->first;
+  }
+}
+
+void Fuzzer::GetServerUpdates() {
+  std::list<Sample *> new_samples;
+
+  // the counters aren't protected by a mutex,
+  // the stats only need to be roughly accurate
+  ClientStats stats;
+  stats.total_execs = total_execs;
+  stats.execs_per_sec = cur_execs_per_sec;
+  stats.num_hangs = num_hangs;
+  stats.num_crashes = num_crashes;
+  stats.num_unique_crashes = num_unique_crashes;
+  stats.num_target_starts = num_target_starts;
+  stats.num_samples = num_samples;
+  stats.num_offsets = cur_num_offsets;
+
+  queue_mutex.Lock();
+  stats.queue_size = sample_queue.size();
+  queue_mutex.Unlock();
+
+  server_mutex.Lock();
+  server->GetUpdates(new_samples, stats);
+  last_server_update_time_ms = GetCurTime();
+  server_mutex.Unlock();
+
+  server_queue_mutex.Lock();
+  server_samples_incoming.splice(server_samples_incoming.end(), new_samples);
+  server_queue_mutex.Unlock();
+}
+
+void Fuzzer::RunServerSyncThread() {
+  uint64_t last_report_time = GetCurTime();
+
+  while (1) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(SERVER_SYNC_POLL_INTERVAL);
+#else
+    usleep(SERVER_SYNC_POLL_INTERVAL * 1000);
+#endif
+
+    server_queue_mutex.Lock();
+    bool initial_sync = initial_server_sync_pending;
+    server_queue_mutex.Unlock();
+
+    uint64_t cur_time = GetCurTime();
+
+    if (initial_sync || (cur_time > (last_report_time + server_report_interval_ms))) {
+      FlushServerReports();
+      last_report_time = cur_time;
+    }
+
+    if (initial_sync) {
+      // report everything found in the input samples
+      coverage_mutex.Lock();
+      Coverage initial_coverage = fuzzer_coverage;
+      coverage_mutex.Unlock();
+
+      server_mutex.Lock();
+      server->ReportNewCoverage(&initial_coverage, NULL);
+      server_mutex.Unlock();
+
+      GetServerUpdates();
+
+      server_queue_mutex.Lock();
+      initial_server_sync_pending = false;
+      server_queue_mutex.Unlock();
+    } else if ((state == FUZZING) &&
+               (cur_time > (last_server_update_time_ms + server_update_interval_ms)))
+    {
+      GetServerUpdates();
+    }
+  }
+}
+
+void Fuzzer::RunLocalSyncThread() {
+  while (1) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(LOCAL_SYNC_POLL_INTERVAL);
+#else
+    usleep(LOCAL_SYNC_POLL_INTERVAL * 1000);
+#endif
+
+    std::list<Sample *> new_samples;
+    local_sync->GetNewSamples(new_samples);
+    if (new_samples.empty()) continue;
+
+    server_queue_mutex.Lock();
+    server_samples_incoming.splice(server_samples_incoming.end(), new_samples);
+    // set while holding the mutex, or a fuzzing thread could pick
+    // up the samples and clear the flag before it gets set
+    local_sync_samples_pending = true;
+    server_queue_mutex.Unlock();
+  }
+}
+
 RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t init_timeout, uint32_t timeout) {
   RunResult result;
 
@@ -341,6 +906,7 @@ RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t
     }
 
     result = tc->instrumentation->RunWithCrashAnalysis(tc->target_argc, tc->target_argv, init_timeout, timeout);
+    num_target_starts += tc->instrumentation->GetNumTargetStarts();
     tc->instrumentation->ClearCoverage();
 
     if (result == CRASH) return result;
@@ -349,7 +915,7 @@ RunResult Fuzzer::TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t
   return result;
 }
 
-void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout, Sample *original_sample) {
+Fuzzer::SampleQueueEntry *Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout, Sample *original_sample) {
   std::vector<Range> ranges;
   if (track_ranges) {
     // need to rerun the sample as the minimizer could have changed ranges
@@ -372,6 +938,8 @@ void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout
   num_samples++;
   output_mutex.Unlock();
 
+  if (server) server->AddKnownSample(sample);
+
   SampleQueueEntry *new_entry = new SampleQueueEntry();
   Sample *new_sample = new Sample(*sample);
   new_entry->sample = new_sample;
@@ -389,6 +957,7 @@ void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout
   new_entry->sample_index = num_samples - 1;
   new_entry->sample_filename = filename;
   new_entry->ranges = ranges;
+  new_entry->exec_time = tc->sample_exec_time;
 
   if (!keep_samples_in_memory) {
     new_sample->filename = outfile;
@@ -396,10 +965,14 @@ void Fuzzer::SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout
   }
 
   queue_mutex.Lock();
+  new_entry->corpus_index = all_samples.size();
   all_samples.push_back(new_sample);
   all_entries.push_back(new_entry);
   sample_queue.push(new_entry);
+  corpus_view_dirty = true;
   queue_mutex.Unlock();
+
+  return new_entry;
 }
 
 RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_coverage, bool trim, bool report_to_server, uint32_t init_timeout, uint32_t timeout, Sample *original_sample) {
@@ -409,20 +982,65 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
 
   Coverage initialCoverage;
 
+  if (incremental_coverage && propagate_coverage) ApplyCoverageUpdates(tc);
+
   RunResult result = RunSampleAndGetCoverage(tc, sample, &initialCoverage, init_timeout, timeout);
+  tc->sample_exec_time = tc->last_exec_time;
 
   if (result != OK) return result;
 
+  // fast path: coverage is identical to a run that was already processed
+  uint64_t path_hash = tc->instrumentation->GetPathHash();
+  if (path_hash && (tc->seen_paths.find(path_hash) != tc->seen_paths.end())) {
+    return result;
+  }
+
   if (!IsReturnValueInteresting(tc->instrumentation->GetReturnValue())) return result;
 
-  if (initialCoverage.empty()) return result;
+  if (initialCoverage.empty()) {
+    AddSeenPath(tc, path_hash);
+    return result;
+  }
+
+  Coverage newCoverage;
+  if(incremental_coverage) {
+    newCoverage = initialCoverage;
+  } else {
+    CoverageDifference(tc->thread_coverage, initialCoverage, newCoverage);
+    if(newCoverage.empty()) {
+      AddSeenPath(tc, path_hash);
+      return result;
+    }
+  }
 
-  if(!incremental_coverage) {
-    Coverage new_thread_coverage;
-    CoverageDifference(tc->thread_coverage, initialCoverage, new_thread_coverage);
-    if(new_thread_coverage.empty()) return result;
+  // known flaky edges don't count as new coverage. Retrying the
+  // sample is only needed if some of the new edges are neither known
+  // to be stable nor found by another thread since the last update
+  Coverage novelCoverage, unknownCoverage, flakyCoverage;
+  coverage_mutex.Lock();
+  CoverageDifference(flaky_edges, newCoverage, novelCoverage);
+  CoverageDifference(stable_edges, novelCoverage, unknownCoverage);
+  if (propagate_coverage && !unknownCoverage.empty()) {
+    Coverage tmpCoverage;
+    CoverageDifference(fuzzer_coverage, unknownCoverage, tmpCoverage);
+    unknownCoverage = tmpCoverage;
   }
-  
+  if (unknownCoverage.empty()) {
+    CoverageIntersection(flaky_edges, initialCoverage, flakyCoverage);
+  }
+  coverage_mutex.Unlock();
+
+  if (novelCoverage.empty()) {
+    if(incremental_coverage) {
+      tc->instrumentation->IgnoreCoverage(initialCoverage);
+    } else {
+      MergeCoverage(tc->thread_coverage, initialCoverage);
+    }
+    AddSeenPath(tc, path_hash);
+    num_retries_saved += coverage_reproduce_retries;
+    return result;
+  }
+
   // printf("found new coverage: \n");
   // PrintCoverage(initialCoverage);
 
@@ -431,15 +1049,28 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
   Coverage stableCoverage = initialCoverage;
   Coverage totalCoverage = initialCoverage;
 
-  // have a clean target before retrying the sample
-  if(clean_target_on_coverage) tc->instrumentation->CleanTarget();
+  int num_retries = coverage_reproduce_retries;
+  if (unknownCoverage.empty()) {
+    Coverage tmpCoverage;
+    CoverageDifference(flakyCoverage, initialCoverage, tmpCoverage);
+    stableCoverage = tmpCoverage;
+    num_retries_saved += num_retries;
+    num_retries = 0;
+  } else if(clean_target_on_coverage) {
+    // have a clean target before retrying the sample
+    tc->instrumentation->CleanTarget();
+  }
 
-  for (int i = 0; i < coverage_reproduce_retries; i++) {
+  for (int i = 0; i < num_retries; i++) {
     Coverage retryCoverage, tmpCoverage;
 
     result = RunSampleAndGetCoverage(tc, sample, &retryCoverage, init_timeout, timeout);
     if (result != OK) return result;
 
+    if (tc->last_exec_time > tc->sample_exec_time) {
+      tc->sample_exec_time = tc->last_exec_time;
+    }
+
     // printf("Retry %d, coverage:\n", i);
     // PrintCoverage(retryCoverage);
 
@@ -452,6 +1083,8 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
   Coverage variableCoverage;
   CoverageDifference(stableCoverage, totalCoverage, variableCoverage);
 
+  if (num_retries) UpdateEdgeStability(stableCoverage, variableCoverage);
+
   // printf("Stable coverage:\n");
   // PrintCoverage(stableCoverage);
   // printf("Variable coverage:\n");
@@ -462,21 +1095,26 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
       *has_new_coverage = 1;
     }
 
-    if (trim && minimize_samples) MinimizeSample(tc, sample, &stableCoverage, init_timeout, timeout);
+    // the unminimized sample enters the queue immediately and
+    // gets reported once the minimization threads are done with it
+    bool minimize_later = trim && minimize_samples && CanQueueForMinimization();
 
-    if (server && report_to_server) {
-      server_mutex.Lock();
-      server->ReportNewCoverage(&stableCoverage, sample);
-      server_mutex.Unlock();
+    if (!minimize_later) {
+      if (trim && minimize_samples) MinimizeSample(tc, sample, &stableCoverage, init_timeout, timeout);
+
+      if (server && report_to_server) QueueCoverageReport(&stableCoverage, sample);
+      if (local_sync && report_to_server) local_sync->Publish(sample, stableCoverage);
     }
     
-    SaveSample(tc, sample, init_timeout, timeout, original_sample);
+    SampleQueueEntry *entry = SaveSample(tc, sample, init_timeout, timeout, original_sample);
+
+    if (minimize_later) {
+      QueueForMinimization(entry, sample, &stableCoverage, report_to_server, init_timeout, timeout);
+    }
   } 
   
   if (!variableCoverage.empty() && server && report_to_server) {
-    server_mutex.Lock();
-    server->ReportNewCoverage(&variableCoverage, NULL);
-    server_mutex.Unlock();
+    QueueCoverageReport(&variableCoverage, NULL);
   }
 
   // printf("Total coverage:\n");
@@ -488,9 +1126,20 @@ RunResult Fuzzer::RunSample(ThreadContext *tc, Sample *sample, int *has_new_cove
     MergeCoverage(tc->thread_coverage, totalCoverage);
   }
 
+  // all coverage from the initial run has now been accounted for
+  AddSeenPath(tc, path_hash);
+
   return result;
 }
 
+void Fuzzer::AddSeenPath(ThreadContext *tc, uint64_t path_hash) {
+  if (!path_hash) return;
+  if (tc->seen_paths.size() >= MAX_SEEN_PATHS) {
+    tc->seen_paths.clear();
+  }
+  tc->seen_paths.insert(path_hash);
+}
+
 void Fuzzer::MinimizeSample(ThreadContext *tc, Sample *sample, Coverage* stable_coverage, uint32_t init_timeout, uint32_t timeout) {
   Minimizer* minimizer = tc->minimizer;
   
@@ -523,6 +1172,120 @@ void Fuzzer::MinimizeSample(ThreadContext *tc, Sample *sample, Coverage* stable_
 }
 
 
+bool Fuzzer::CanQueueForMinimization() {
+  if (!num_minimize_threads) return false;
+
+  minimize_mutex.Lock();
+  bool ret = (minimize_queue.size() < MAX_MINIMIZE_QUEUE_SIZE);
+  minimize_mutex.Unlock();
+
+  return ret;
+}
+
+void Fuzzer::QueueForMinimization(SampleQueueEntry *entry, Sample *sample, Coverage *stable_coverage, bool report_to_server, uint32_t init_timeout, uint32_t timeout) {
+  minimize_mutex.Lock();
+  minimize_queue.push_back({ entry, new Sample(*sample), *stable_coverage, report_to_server, init_timeout, timeout });
+  samples_pending_minimization++;
+  minimize_mutex.Unlock();
+}
+
+void Fuzzer::RunMinimizeThread(ThreadContext *tc) {
+  while (1) {
+    minimize_mutex.Lock();
+    if (minimize_queue.empty()) {
+      minimize_mutex.Unlock();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(MINIMIZE_POLL_INTERVAL);
+#else
+      usleep(MINIMIZE_POLL_INTERVAL * 1000);
+#endif
+      continue;
+    }
+    MinimizationJob job = minimize_queue.front();
+    minimize_queue.pop_front();
+    minimize_mutex.Unlock();
+
+    // this thread never ignores coverage, so the instrumentation
+    // reports the full coverage of each minimization attempt
+    size_t original_size = job.sample->size;
+    MinimizeSample(tc, job.sample, &job.stable_coverage, job.init_timeout, job.timeout);
+
+    if (server && job.report_to_server) QueueCoverageReport(&job.stable_coverage, job.sample);
+    if (local_sync && job.report_to_server) local_sync->Publish(job.sample, job.stable_coverage);
+
+    size_t bytes_removed = original_size - job.sample->size;
+
+    if (bytes_removed) {
+      std::vector<Range> ranges;
+      if (track_ranges) {
+        Coverage tmp_coverage;
+        RunResult result = RunSampleAndGetCoverage(tc, job.sample, &tmp_coverage, job.init_timeout, job.timeout);
+        if (result == OK) {
+          tc->range_tracker->ExtractRanges(&ranges);
+        }
+      }
+
+      // the minimized file is written next to the original one
+      // and only replaces it when the sample gets swapped in
+      string outfile = DirJoin(sample_dir, job.entry->sample_filename);
+      string temp_file = outfile + ".tmp";
+      output_mutex.Lock();
+      job.sample->Save(temp_file.c_str());
+      output_mutex.Unlock();
+
+      if (server) server->AddKnownSample(job.sample);
+
+      MutatorSampleContext *context = tc->mutator->CreateSampleContext(job.sample);
+      if (TrackHotOffsets() && keep_samples_in_memory) {
+        size_t mutation_offset = sample_trie.AddSample(job.sample);
+        tc->mutator->AddHotOffset(context, mutation_offset);
+      }
+
+      if (!keep_samples_in_memory) {
+        job.sample->filename = outfile;
+        job.sample->FreeMemory();
+      }
+
+      queue_mutex.Lock();
+      job.entry->minimized_sample = job.sample;
+      job.entry->minimized_context = context;
+      job.entry->minimized_ranges.swap(ranges);
+      if (!job.entry->in_use) ApplyMinimizedSample(job.entry);
+      queue_mutex.Unlock();
+    } else {
+      delete job.sample;
+    }
+
+    minimize_mutex.Lock();
+    if (bytes_removed) {
+      num_samples_minimized++;
+      num_bytes_minimized += bytes_removed;
+    }
+    samples_pending_minimization--;
+    minimize_mutex.Unlock();
+  }
+}
+
+// called with queue_mutex locked, while the entry isn't being fuzzed
+void Fuzzer::ApplyMinimizedSample(SampleQueueEntry *entry) {
+  string outfile = DirJoin(sample_dir, entry->sample_filename);
+  string temp_file = outfile + ".tmp";
+  remove(outfile.c_str());
+  rename(temp_file.c_str(), outfile.c_str());
+
+  all_samples[entry->corpus_index] = entry->minimized_sample;
+  replaced_samples.push_back(entry->sample);
+  corpus_view_dirty = true;
+
+  delete entry->context;
+  entry->sample = entry->minimized_sample;
+  entry->context = entry->minimized_context;
+  entry->ranges.swap(entry->minimized_ranges);
+  entry->minimized_sample = NULL;
+  entry->minimized_context = NULL;
+  entry->minimized_ranges.clear();
+}
+
 int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage) {
   coverage_mutex.Lock();
 
@@ -535,6 +1298,15 @@ int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stabl
   MergeCoverage(fuzzer_coverage, new_stable_coverage);
   MergeCoverage(fuzzer_coverage, new_variable_coverage);
 
+  if (incremental_coverage && propagate_coverage &&
+      (!new_stable_coverage.empty() || !new_variable_coverage.empty()))
+  {
+    coverage_updates.push_back({ tc->thread_id, new_stable_coverage });
+    MergeCoverage(coverage_updates.back().coverage, new_variable_coverage);
+    coverage_epoch.store(coverage_updates_base + coverage_updates.size(),
+                         std::memory_order_release);
+  }
+
   coverage_mutex.Unlock();
 
   // printf("New stable coverage:\n");
@@ -550,6 +1322,107 @@ int Fuzzer::InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stabl
   return 0;
 }
 
+static size_t GetNumOffsets(Coverage &coverage) {
+  size_t num_offsets = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    num_offsets += iter->offsets.size();
+  }
+  return num_offsets;
+}
+
+void Fuzzer::UpdateEdgeStability(Coverage &stable, Coverage &variable) {
+  Coverage new_stable, new_flaky, no_longer_stable, tmp;
+
+  coverage_mutex.Lock();
+
+  // an edge is flaky as soon as it's seen as variable once
+  CoverageDifference(flaky_edges, variable, new_flaky);
+  CoverageIntersection(stable_edges, new_flaky, no_longer_stable);
+  if (!no_longer_stable.empty()) {
+    CoverageDifference(no_longer_stable, stable_edges, tmp);
+    stable_edges = tmp;
+    num_stable_edges -= GetNumOffsets(no_longer_stable);
+  }
+  MergeCoverage(flaky_edges, new_flaky);
+  num_flaky_edges += GetNumOffsets(new_flaky);
+
+  tmp.clear();
+  CoverageDifference(flaky_edges, stable, tmp);
+  CoverageDifference(stable_edges, tmp, new_stable);
+  MergeCoverage(stable_edges, new_stable);
+  num_stable_edges += GetNumOffsets(new_stable);
+
+  coverage_mutex.Unlock();
+}
+
+void Fuzzer::SaveEdgeStability() {
+  std::string out_file = DirJoin(out_dir, std::string("stability.dat"));
+  FILE *fp = fopen(out_file.c_str(), "wb");
+  if (!fp) {
+    WARN("Error saving edge stability");
+    return;
+  }
+  WriteCoverageBinary(stable_edges, fp);
+  WriteCoverageBinary(flaky_edges, fp);
+  fclose(fp);
+}
+
+void Fuzzer::LoadEdgeStability() {
+  // not present for sessions started by older versions
+  std::string out_file = DirJoin(out_dir, std::string("stability.dat"));
+  FILE *fp = fopen(out_file.c_str(), "rb");
+  if (!fp) return;
+  ReadCoverageBinary(stable_edges, fp);
+  ReadCoverageBinary(flaky_edges, fp);
+  fclose(fp);
+
+  num_stable_edges = GetNumOffsets(stable_edges);
+  num_flaky_edges = GetNumOffsets(flaky_edges);
+}
+
+// called with coverage_mutex locked
+void Fuzzer::TrimCoverageUpdates() {
+  // threads that haven't started fuzzing yet have an epoch
+  // of 0 and will ignore the whole fuzzer_coverage instead
+  size_t min_epoch = coverage_updates_base + coverage_updates.size();
+  for (ThreadContext *tc : corpus_readers) {
+    if (tc->coverage_epoch < min_epoch) min_epoch = tc->coverage_epoch;
+  }
+
+  while (coverage_updates_base < min_epoch) {
+    coverage_updates.pop_front();
+    coverage_updates_base++;
+  }
+}
+
+void Fuzzer::ApplyCoverageUpdates(ThreadContext *tc) {
+  if (!tc->coverage_initialized) return;
+  if (coverage_epoch.load(std::memory_order_acquire) == tc->coverage_epoch) return;
+
+  Coverage new_coverage;
+
+  coverage_mutex.Lock();
+  size_t epoch = coverage_updates_base + coverage_updates.size();
+  for (size_t i = tc->coverage_epoch; i < epoch; i++) {
+    CoverageUpdate &update = coverage_updates[i - coverage_updates_base];
+    // the thread already ignores the coverage it found itself
+    if (update.thread_id == tc->thread_id) continue;
+    MergeCoverage(new_coverage, update.coverage);
+  }
+  tc->coverage_epoch = epoch;
+  TrimCoverageUpdates();
+  coverage_mutex.Unlock();
+
+  if (new_coverage.empty()) return;
+
+  tc->instrumentation->IgnoreCoverage(new_coverage);
+
+  // not protected by a mutex, same as total_execs
+  for (auto iter = new_coverage.begin(); iter != new_coverage.end(); iter++) {
+    num_propagated_offsets += iter->offsets.size();
+  }
+}
+
 void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   queue_mutex.Lock();
   
@@ -561,7 +1434,8 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   }
   
   // only save state while fuzzing
-  if(state == FUZZING) {
+  // and after all entries were restored
+  if((state == FUZZING) && !entries_pending_restore) {
     uint64_t cur_time = GetCurTime();
     if((cur_time > last_save_time) &&
        (((cur_time - last_save_time) / 1000) > FUZZER_SAVE_INERVAL))
@@ -577,43 +1451,46 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
     if(incremental_coverage) {
       coverage_mutex.Lock();
       tc->instrumentation->IgnoreCoverage(fuzzer_coverage);
+      tc->coverage_epoch = coverage_updates_base + coverage_updates.size();
       coverage_mutex.Unlock();
     }
     tc->coverage_initialized = true;
   }
 
-  // sync all_samples_local with all_samples
-  if (all_samples.size() > tc->all_samples_local.size()) {
-    size_t old_size = tc->all_samples_local.size();
-    tc->all_samples_local.resize(all_samples.size());
-    for (size_t i = old_size; i < all_samples.size(); i++) {
-      tc->all_samples_local[i] = all_samples[i];
-    }
+  // make new samples visible to the mutators
+  if (corpus_view_dirty) {
+    PublishCorpusView();
+  } else if (!retired_corpus_views.empty()) {
+    ReclaimCorpusViews();
   }
 
   // change state if needed
 
-  if ((state == FUZZING) && server &&
-    (GetCurTime() > (last_server_update_time_ms + server_update_interval_ms)))
-  {
-    last_server_update_time_ms = GetCurTime();
-    server_mutex.Lock();
-    server->GetUpdates(server_samples, total_execs);
-    server_mutex.Unlock();
-    state = SERVER_SAMPLE_PROCESSING;
+  // pick up the samples fetched by the server
+  // and local sync threads
+  bool server_sync_pending = false;
+  if (server || local_sync) {
+    server_queue_mutex.Lock();
+    if (!server_samples_incoming.empty() &&
+        ((state == FUZZING) || (state == SERVER_SAMPLE_PROCESSING)))
+    {
+      server_samples.splice(server_samples.end(), server_samples_incoming);
+      state = SERVER_SAMPLE_PROCESSING;
+      local_sync_samples_pending = false;
+    }
+    server_sync_pending = initial_server_sync_pending;
+    server_queue_mutex.Unlock();
   }
 
   if (state == INPUT_SAMPLE_PROCESSING) {
-    if (input_files.empty() && !samples_pending) {
+    if (InputLoadingDone() && !samples_pending) {
+      if (adaptive_timeout) CalibrateTimeout();
       if (server) {
         if(!skip_initial_server_sync) {
-          server_mutex.Lock();
-          coverage_mutex.Lock();
-          server->ReportNewCoverage(&fuzzer_coverage, NULL);
-          coverage_mutex.Unlock();
-          last_server_update_time_ms = GetCurTime();
-          server->GetUpdates(server_samples, total_execs);
-          server_mutex.Unlock();
+          server_queue_mutex.Lock();
+          initial_server_sync_pending = true;
+          server_queue_mutex.Unlock();
+          server_sync_pending = true;
         }
         last_server_update_time_ms = GetCurTime();
         state = SERVER_SAMPLE_PROCESSING;
@@ -624,7 +1501,7 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   }
   
   if (state == SERVER_SAMPLE_PROCESSING) {
-    if (server_samples.empty() && !samples_pending) {
+    if (server_samples.empty() && !samples_pending && !server_sync_pending) {
       state = FUZZING;
     }
   }
@@ -654,21 +1531,21 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
       job->type = FUZZ;
       job->entry = sample_queue.top();
       sample_queue.pop();
+      job->entry->in_use = true;
     }
   } else if (state == INPUT_SAMPLE_PROCESSING) {
-    if (input_files.empty()) {
+    // samples were already read by the loader threads
+    input_mutex.Lock();
+    if (input_samples.empty()) {
+      input_mutex.Unlock();
       job->type = WAIT;
     } else {
       job->type = PROCESS_SAMPLE;
-      std::string filename = input_files.front();
-      input_files.pop_front();
-      printf("Running input sample %s\n", filename.c_str());
-      job->sample = new Sample();
-      job->sample->Load(filename.c_str());
-      if (job->sample->size > Sample::max_size) {
-        WARN("Input sample larger than maximum sample size. Will be trimmed");
-        job->sample->Trim(Sample::max_size);
-      }
+      printf("Running input sample %s\n", input_samples.front().first.c_str());
+      job->sample = input_samples.front().second;
+      job->report_sample = true;
+      input_samples.pop_front();
+      input_mutex.Unlock();
       samples_pending++;
     }
   } else if (state == SERVER_SAMPLE_PROCESSING) {
@@ -677,6 +1554,7 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
     } else {
       job->type = PROCESS_SAMPLE;
       job->sample = server_samples.front();
+      job->report_sample = false;
       server_samples.pop_front();
       samples_pending++;
     }
@@ -687,6 +1565,7 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
       job->type = PROCESS_SAMPLE;
       job->sample = new Sample();
       tc->mutator->GenerateSample(job->sample, tc->prng);
+      job->report_sample = true;
       samples_pending++;
     }
   } else {
@@ -696,10 +1575,70 @@ void Fuzzer::SynchronizeAndGetJob(ThreadContext* tc, FuzzerJob* job) {
   queue_mutex.Unlock();
 }
 
+Fuzzer::CorpusView *Fuzzer::AcquireCorpusView(ThreadContext *tc) {
+  CorpusView *view;
+  while (1) {
+    // the epoch is announced before the view is loaded. Only views
+    // older than the announced epoch can get reclaimed, and the view
+    // loaded afterwards is at least as new as the announced one
+    uint64_t epoch = corpus_epoch.load();
+    tc->corpus_view_epoch.store(epoch);
+    view = corpus_view.load();
+    // if a newer view was published in the meantime, announce
+    // its epoch instead so that older ones can be reclaimed
+    if (corpus_epoch.load() == epoch) break;
+  }
+  return view;
+}
+
+void Fuzzer::ReleaseCorpusView(ThreadContext *tc) {
+  tc->corpus_view_epoch.store(CORPUS_VIEW_IDLE);
+}
+
+// called with queue_mutex locked
+void Fuzzer::PublishCorpusView() {
+  CorpusView *old_view = corpus_view.load();
+
+  CorpusView *new_view = new CorpusView();
+  new_view->epoch = old_view->epoch + 1;
+  new_view->samples = all_samples;
+  corpus_view.store(new_view);
+  corpus_epoch.store(new_view->epoch);
+
+  retired_corpus_views.push_back({ old_view, replaced_samples });
+  replaced_samples.clear();
+  corpus_view_dirty = false;
+
+  ReclaimCorpusViews();
+}
+
+// called with queue_mutex locked
+void Fuzzer::ReclaimCorpusViews() {
+  uint64_t min_epoch = CORPUS_VIEW_IDLE;
+  for (ThreadContext *tc : corpus_readers) {
+    uint64_t epoch = tc->corpus_view_epoch.load();
+    if (epoch < min_epoch) min_epoch = epoch;
+  }
+
+  // views are retired in the order of their epochs
+  while (!retired_corpus_views.empty() &&
+         (retired_corpus_views.front().view->epoch < min_epoch))
+  {
+    RetiredCorpusView &retired = retired_corpus_views.front();
+    for (Sample *sample : retired.removed_samples) {
+      delete sample;
+    }
+    delete retired.view;
+    retired_corpus_views.pop_front();
+  }
+}
+
 void Fuzzer::JobDone(FuzzerJob* job) {
   queue_mutex.Lock();
 
   if (job->type == FUZZ) {
+    job->entry->in_use = false;
+    if (job->entry->minimized_sample) ApplyMinimizedSample(job->entry);
     if (job->discard_sample) {
       job->entry->discarded = 1;
       num_samples_discarded++;
@@ -716,6 +1655,8 @@ void Fuzzer::JobDone(FuzzerJob* job) {
 
 void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
   SampleQueueEntry* entry = job->entry;
+
+  EnsureEntryRestored(tc, entry);
   
   tc->mutator->InitRound(entry->sample, entry->context);
 
@@ -727,15 +1668,19 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
 
   entry->sample->EnsureLoaded();
 
+  uint32_t sample_timeout = GetSampleTimeout(entry);
+
+  CorpusView *view = AcquireCorpusView(tc);
+
   while (1) {
     Sample mutated_sample = *entry->sample;
-    if (!tc->mutator->Mutate(&mutated_sample, tc->prng, tc->all_samples_local)) break;
+    if (!tc->mutator->Mutate(&mutated_sample, tc->prng, view->samples)) break;
     if (mutated_sample.size > Sample::max_size) {
       continue;
     }
 
     int has_new_coverage;
-    RunResult result = RunSample(tc, &mutated_sample, &has_new_coverage, true, true, init_timeout, timeout, entry->sample);
+    RunResult result = RunSample(tc, &mutated_sample, &has_new_coverage, true, true, init_timeout, sample_timeout, entry->sample);
     AdjustSamplePriority(tc, entry, has_new_coverage);
     tc->mutator->NotifyResult(result, has_new_coverage);
 
@@ -764,8 +1709,12 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
       job->discard_sample = true;
       break;
     }
+
+    if (local_sync_samples_pending.load(std::memory_order_relaxed)) break;
   }
 
+  ReleaseCorpusView(tc);
+
   if (!keep_samples_in_memory) {
     entry->sample->FreeMemory();
   }
@@ -774,7 +1723,7 @@ void Fuzzer::FuzzJob(ThreadContext* tc, FuzzerJob* job) {
 void Fuzzer::ProcessSample(ThreadContext* tc, FuzzerJob* job) {
   int has_new_coverage = 0;
   job->sample->EnsureLoaded();
-  RunResult result = RunSample(tc, job->sample, &has_new_coverage, false, false, init_timeout, corpus_timeout, NULL);
+  RunResult result = RunSample(tc, job->sample, &has_new_coverage, false, job->report_sample, init_timeout, corpus_timeout, NULL);
   if (result == CRASH) {
     WARN("Input sample resulted in a crash");
   } else if (result == HANG) {
@@ -822,6 +1771,35 @@ void Fuzzer::DumpCoverage() {
   WriteCoverage(fuzzer_coverage, out_file.c_str());
 }
 
+// state files can be larger than 2GB
+static uint64_t StateFileTell(FILE *fp) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  return (uint64_t)_ftelli64(fp);
+#else
+  return (uint64_t)ftello(fp);
+#endif
+}
+
+static void StateFileSeek(FILE *fp, uint64_t offset) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+  fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static uint64_t StateFileSize(FILE *fp) {
+  uint64_t offset = StateFileTell(fp);
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  _fseeki64(fp, 0, SEEK_END);
+#else
+  fseeko(fp, 0, SEEK_END);
+#endif
+  uint64_t size = StateFileTell(fp);
+  StateFileSeek(fp, offset);
+  return size;
+}
+
 void Fuzzer::SaveState(ThreadContext *tc) {
   // don't save during input sample processing
   if(state == INPUT_SAMPLE_PROCESSING) return;
@@ -835,6 +1813,11 @@ void Fuzzer::SaveState(ThreadContext *tc) {
     FATAL("Error saving state");
   }
 
+  uint64_t magic = STATE_FILE_MAGIC;
+  uint64_t version = STATE_VERSION;
+  fwrite(&magic, sizeof(magic), 1, fp);
+  fwrite(&version, sizeof(version), 1, fp);
+
   fwrite(&num_samples, sizeof(num_samples), 1, fp);
   fwrite(&num_samples_discarded, sizeof(num_samples_discarded), 1, fp);
   fwrite(&total_execs, sizeof(total_execs), 1, fp);
@@ -847,9 +1830,24 @@ void Fuzzer::SaveState(ThreadContext *tc) {
   fwrite(&num_entries, sizeof(num_entries), 1, fp);
   for(SampleQueueEntry *entry : all_entries) {
     entry->Save(fp);
+
+    // the size of the context is filled in afterwards,
+    // so that it can be skipped when restoring
+    uint64_t context_size = 0;
+    uint64_t size_offset = StateFileTell(fp);
+    fwrite(&context_size, sizeof(context_size), 1, fp);
     tc->mutator->SaveContext(entry->context, fp);
+    uint64_t end_offset = StateFileTell(fp);
+    context_size = end_offset - size_offset - sizeof(context_size);
+    StateFileSeek(fp, size_offset);
+    fwrite(&context_size, sizeof(context_size), 1, fp);
+    StateFileSeek(fp, end_offset);
   }
 
+  uint64_t has_client_state = server ? 1 : 0;
+  fwrite(&has_client_state, sizeof(has_client_state), 1, fp);
+  // the client state has its own lock, server_mutex
+  // can be held for long while the server is unreachable
   if (server) server->SaveState(fp);
 
   // let every correctly saved state end with
@@ -858,6 +1856,8 @@ void Fuzzer::SaveState(ThreadContext *tc) {
   fwrite(&sentry, sizeof(sentry), 1, fp);
 
   fclose(fp);
+
+  SaveEdgeStability();
   
   if(dump_coverage) DumpCoverage();
 
@@ -875,7 +1875,21 @@ void Fuzzer::RestoreState(ThreadContext *tc) {
     FATAL("Error restoring state. Did the previous session run long enough for state to be saved?");
   }
 
-  fread(&num_samples, sizeof(num_samples), 1, fp);
+  uint64_t magic, version;
+  fread(&magic, sizeof(magic), 1, fp);
+  if (magic == STATE_FILE_MAGIC) {
+    fread(&version, sizeof(version), 1, fp);
+    if (version != STATE_VERSION) {
+      FATAL("State file was saved by an incompatible version of the fuzzer");
+    }
+    fread(&num_samples, sizeof(num_samples), 1, fp);
+  } else {
+    version = 0;
+    num_samples = magic;
+  }
+  // in versioned state files each mutator context is preceded
+  // by its size, older ones can only be restored all at once
+  bool lazy = (version != 0);
   fread(&num_samples_discarded, sizeof(num_samples_discarded), 1, fp);
   fread(&total_execs, sizeof(total_execs), 1, fp);
  
@@ -886,12 +1900,36 @@ void Fuzzer::RestoreState(ThreadContext *tc) {
   uint64_t num_entries;
   fread(&num_entries, sizeof(num_entries), 1, fp);
 
+  restore_mutex.Lock();
+
   for (uint64_t i = 0; i < num_entries; i++) {
+    if (lazy) {
+      SampleQueueEntry *entry = new SampleQueueEntry;
+      entry->Load(fp, version);
+
+      uint64_t context_size;
+      fread(&context_size, sizeof(context_size), 1, fp);
+      entry->restore_offset = StateFileTell(fp);
+      StateFileSeek(fp, entry->restore_offset + context_size);
+
+      // an empty placeholder until the sample is loaded
+      entry->sample = new Sample();
+      entry->restore_state = ENTRY_RESTORE_PENDING;
+      restore_entries.push_back(entry);
+
+      all_entries.push_back(entry);
+      if(!entry->discarded) sample_queue.push(entry);
+
+      if (adaptive_timeout) exec_times.push_back(entry->exec_time);
+      continue;
+    }
+
     Sample *sample = new Sample();
     SampleQueueEntry *entry = new SampleQueueEntry;
-    entry->Load(fp);
+    entry->Load(fp, version);
     string outfile = DirJoin(sample_dir, entry->sample_filename);
     sample->Load(outfile.c_str());
+    if (server) server->AddKnownSample(sample);
     entry->sample = sample;
     entry->context = tc->mutator->CreateSampleContext(sample);
     tc->mutator->LoadContext(entry->context, fp);
@@ -907,12 +1945,34 @@ void Fuzzer::RestoreState(ThreadContext *tc) {
       entry->sample->FreeMemory();
     }
 
+    entry->corpus_index = all_samples.size();
     all_samples.push_back(sample);
     all_entries.push_back(entry);
     if(!entry->discarded) sample_queue.push(entry);
+    corpus_view_dirty = true;
+
+    // restored samples also count towards timeout calibration,
+    // if the state file recorded their exec time
+    if (adaptive_timeout && version) exec_times.push_back(entry->exec_time);
   }
   
-  if (server) server->LoadState(fp);
+  // the client state is only present if the previous session
+  // was connected to a server. Older state files don't say so,
+  // but then it's the only thing besides the sentry left to read
+  uint64_t has_client_state;
+  if (version) {
+    fread(&has_client_state, sizeof(has_client_state), 1, fp);
+  } else {
+    has_client_state =
+      ((StateFileSize(fp) - StateFileTell(fp)) > sizeof(uint64_t)) ? 1 : 0;
+  }
+  if (has_client_state) {
+    if (server) {
+      server->LoadState(fp);
+    } else {
+      StateFileSeek(fp, StateFileSize(fp) - sizeof(uint64_t));
+    }
+  }
 
   uint64_t sentry;
   fread(&sentry, sizeof(sentry), 1, fp);
@@ -920,12 +1980,165 @@ void Fuzzer::RestoreState(ThreadContext *tc) {
     FATAL("State could not be restored correctly");
   }
 
-  fclose(fp);
+  if (restore_entries.empty()) {
+    fclose(fp);
+  } else {
+    restore_fp = fp;
+    entries_pending_restore = restore_entries.size();
+    SAY("Restored %zu queue entries, loading samples in the background\n", restore_entries.size());
+  }
+  restore_started = true;
+
+  restore_mutex.Unlock();
+
+  LoadEdgeStability();
   
   coverage_mutex.Unlock();
   output_mutex.Unlock();
 }
 
+void Fuzzer::RestoreEntry(ThreadContext *tc, SampleQueueEntry *entry) {
+  Sample *sample = new Sample();
+  string outfile = DirJoin(sample_dir, entry->sample_filename);
+  sample->Load(outfile.c_str());
+  if (server) server->AddKnownSample(sample);
+
+  MutatorSampleContext *context = tc->mutator->CreateSampleContext(sample);
+  restore_mutex.Lock();
+  StateFileSeek(restore_fp, entry->restore_offset);
+  tc->mutator->LoadContext(context, restore_fp);
+  restore_mutex.Unlock();
+
+  if (TrackHotOffsets()) {
+    if (keep_samples_in_memory) {
+      sample_trie.AddSample(sample);
+    }
+  }
+
+  if (!keep_samples_in_memory) {
+    sample->filename = outfile;
+    sample->FreeMemory();
+  }
+
+  // other threads only see the sample
+  // once it's added to all_samples
+  queue_mutex.Lock();
+  delete entry->sample;
+  entry->sample = sample;
+  entry->context = context;
+  entry->corpus_index = all_samples.size();
+  all_samples.push_back(sample);
+  corpus_view_dirty = true;
+  queue_mutex.Unlock();
+
+  restore_mutex.Lock();
+  entry->restore_state = ENTRY_RESTORED;
+  if (entries_pending_restore == 1) {
+    fclose(restore_fp);
+    restore_fp = NULL;
+    SAY("All %zu samples restored\n", restore_entries.size());
+  }
+  entries_pending_restore--;
+  restore_mutex.Unlock();
+}
+
+void Fuzzer::EnsureEntryRestored(ThreadContext *tc, SampleQueueEntry *entry) {
+  if (!entries_pending_restore) return;
+
+  while (1) {
+    restore_mutex.Lock();
+    int restore_state = entry->restore_state;
+    if (restore_state == ENTRY_RESTORE_PENDING) {
+      entry->restore_state = ENTRY_RESTORING;
+    }
+    restore_mutex.Unlock();
+
+    if (restore_state == ENTRY_RESTORED) return;
+
+    if (restore_state == ENTRY_RESTORE_PENDING) {
+      RestoreEntry(tc, entry);
+      return;
+    }
+
+    // being restored by another thread
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(RESTORE_POLL_INTERVAL);
+#else
+    usleep(RESTORE_POLL_INTERVAL * 1000);
+#endif
+  }
+}
+
+void Fuzzer::RunRestoreThread(ThreadContext *tc) {
+  while (1) {
+    restore_mutex.Lock();
+    if (!restore_started) {
+      restore_mutex.Unlock();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(RESTORE_POLL_INTERVAL);
+#else
+      usleep(RESTORE_POLL_INTERVAL * 1000);
+#endif
+      continue;
+    }
+
+    SampleQueueEntry *entry = NULL;
+    while (next_restore_entry < restore_entries.size()) {
+      SampleQueueEntry *candidate = restore_entries[next_restore_entry++];
+      if (candidate->restore_state == ENTRY_RESTORE_PENDING) {
+        candidate->restore_state = ENTRY_RESTORING;
+        entry = candidate;
+        break;
+      }
+    }
+    restore_mutex.Unlock();
+
+    if (!entry) break;
+
+    RestoreEntry(tc, entry);
+  }
+}
+
+void Fuzzer::CalibrateTimeout() {
+  exec_times_mutex.Lock();
+
+  if (exec_times.size() < MIN_CALIBRATION_SAMPLES) {
+    WARN("Not enough runs to calibrate the timeout, using %u ms", timeout);
+    exec_times_mutex.Unlock();
+    return;
+  }
+
+  std::sort(exec_times.begin(), exec_times.end());
+  uint64_t percentile = exec_times[(exec_times.size() * 99) / 100];
+  exec_times.clear();
+
+  exec_times_mutex.Unlock();
+
+  uint64_t new_timeout = percentile * TIMEOUT_CALIBRATION_FACTOR;
+  if (new_timeout < MIN_CALIBRATED_TIMEOUT) new_timeout = MIN_CALIBRATED_TIMEOUT;
+  if (new_timeout > max_timeout) new_timeout = max_timeout;
+
+  timeout = (uint32_t)new_timeout;
+  SAY("Calibrated timeout: %u ms (99th percentile exec time: %llu ms)\n", timeout, percentile);
+}
+
+uint32_t Fuzzer::GetSampleTimeout(SampleQueueEntry *entry) {
+  if (!adaptive_timeout) return timeout;
+
+  uint64_t sample_timeout = entry->exec_time * SAMPLE_TIMEOUT_FACTOR;
+  if (sample_timeout < timeout) return timeout;
+  if (sample_timeout > max_timeout) return max_timeout;
+  return (uint32_t)sample_timeout;
+}
+
+uint32_t Fuzzer::GetHangConfirmTimeout(uint32_t timeout) {
+  if (!adaptive_timeout) return timeout;
+
+  uint64_t confirm_timeout = (uint64_t)timeout * HANG_CONFIRM_FACTOR;
+  if (confirm_timeout > max_timeout) return max_timeout;
+  return (uint32_t)confirm_timeout;
+}
+
 void Fuzzer::AdjustSamplePriority(ThreadContext *tc, SampleQueueEntry *entry, int found_new_coverage) {
   if (found_new_coverage) entry->priority = 0;
   else entry->priority--;
@@ -951,6 +2164,10 @@ Fuzzer::ThreadContext *Fuzzer::CreateThreadContext(int argc, char **argv, int th
   tc->minimizer = CreateMinimizer(argc, argv, tc);
   tc->range_tracker = CreateRangeTracker(argc, argv, tc);
   tc->coverage_initialized = false;
+  tc->coverage_epoch = 0;
+  tc->corpus_view_epoch = CORPUS_VIEW_IDLE;
+  tc->last_exec_time = 0;
+  tc->sample_exec_time = 0;
   
   return tc;
 }
@@ -1059,8 +2276,16 @@ RangeTracker* Fuzzer::CreateRangeTracker(int argc, char** argv, ThreadContext* t
 }
 
 Minimizer* Fuzzer::CreateMinimizer(int argc, char** argv, ThreadContext* tc) {
-  SimpleTrimmer* trimmer = new SimpleTrimmer();
-  return trimmer;
+  char *option = GetOption("-minimizer", argc, argv);
+  if (!option || !strcmp(option, "trim")) {
+    SimpleTrimmer* trimmer = new SimpleTrimmer();
+    return trimmer;
+  } else if (!strcmp(option, "block_delete")) {
+    BlockDeletionTrimmer* trimmer = new BlockDeletionTrimmer();
+    return trimmer;
+  } else {
+    FATAL("Unknown minimizer option");
+  }
 }
 
 bool Fuzzer::OutputFilter(Sample *original_sample, Sample *output_sample, ThreadContext* tc) {
@@ -1084,9 +2309,11 @@ void Fuzzer::SampleQueueEntry::Save(FILE *fp) {
   uint64_t ranges_size = ranges.size();
   fwrite(&ranges_size, sizeof(ranges_size), 1, fp);
   fwrite(ranges.data(), sizeof(ranges[0]), ranges_size, fp);
+
+  fwrite(&exec_time, sizeof(exec_time), 1, fp);
 }
 
-void Fuzzer::SampleQueueEntry::Load(FILE *fp) {
+void Fuzzer::SampleQueueEntry::Load(FILE *fp, uint64_t state_version) {
   uint64_t filename_size;
   fread(&filename_size, sizeof(filename_size), 1, fp);
   char *str_buf = (char *)malloc(filename_size + 1);
@@ -1107,4 +2334,11 @@ void Fuzzer::SampleQueueEntry::Load(FILE *fp) {
   fread(&ranges_size, sizeof(ranges_size), 1, fp);
   ranges.resize(ranges_size);
   fread(ranges.data(), sizeof(ranges[0]), ranges_size, fp);
+
+  // missing in state files saved before versioning
+  if (state_version) {
+    fread(&exec_time, sizeof(exec_time), 1, fp);
+  } else {
+    exec_time = 0;
+  }
 }
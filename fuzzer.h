@@ -20,7 +20,10 @@ limitations under the License.
 #include <list>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include "prng.h"
 #include "mutex.h"
 #include "coverage.h"
@@ -28,6 +31,7 @@ limitations under the License.
 #include "minimizer.h"
 #include "range.h"
 #include "rangetracker.h"
+#include "directory.h"
 
 #ifdef linux
 #include "sancovinstrumentation.h"
@@ -42,6 +46,8 @@ class SampleDelivery;
 class MutatorSampleContext;
 class Sample;
 class CoverageClient;
+class LocalSync;
+class CorpusIndex;
 
 #define DEFAULT_CRASH_REPRODUCE_RETRIES 10
 #define DEFAULT_COVERAGE_REPRODUCE_RETRIES 3
@@ -50,11 +56,71 @@ class CoverageClient;
 
 #define MAX_IDENTICAL_CRASHES 4
 
+#define DEFAULT_TRIAGE_THREADS 1
+// crashes are triaged inline on the fuzzing thread
+// if this many crashes are already waiting for triage
+#define MAX_TRIAGE_QUEUE_SIZE 64
+// how often idle triage threads check the queue (in ms)
+#define TRIAGE_POLL_INTERVAL 100
+
+#define DEFAULT_MINIMIZE_THREADS 1
+// new samples are minimized inline on the fuzzing thread
+// if this many samples are already waiting for minimization
+#define MAX_MINIMIZE_QUEUE_SIZE 256
+// how often idle minimization threads check the queue (in ms)
+#define MINIMIZE_POLL_INTERVAL 100
+
+// input samples are read by this many loader threads
+// ahead of the fuzzing threads that process them
+#define DEFAULT_INPUT_LOADER_THREADS 4
+#define MAX_PREFETCHED_INPUTS 256
+// how often loader threads check if there's space in the queue (in ms)
+#define INPUT_LOADER_POLL_INTERVAL 10
+
 // save state every 5 minutes
 #define FUZZER_SAVE_INERVAL (5 * 60)
 
+// hex('fuzzvers'), written at the start of state files together with
+// the format version. State files saved before versioning was added
+// start with num_samples instead and are restored as version 0.
+// Samples from versioned state files are restored lazily
+// (see restore_mutex), and their client state is preceded
+// by a flag telling if it's present
+#define STATE_FILE_MAGIC 0x66757a7a76657273
+#define STATE_VERSION 1
+// how often threads waiting for a sample being restored
+// by another thread check if it's done (in ms)
+#define RESTORE_POLL_INTERVAL 10
+
 #define MIN_SAMPLES_TO_GENERATE 10
 
+// adaptive timeout parameters (see -adaptive_timeout)
+// calibrated timeout is TIMEOUT_CALIBRATION_FACTOR times the 99th
+// percentile of exec times observed during input sample processing
+#define TIMEOUT_CALIBRATION_FACTOR 5
+#define MIN_CALIBRATED_TIMEOUT 50
+#define MIN_CALIBRATION_SAMPLES 10
+// samples that are slow by themselves get a proportionally longer timeout
+#define SAMPLE_TIMEOUT_FACTOR 3
+// suspected hangs are retried with a timeout this many times longer
+#define HANG_CONFIRM_FACTOR 4
+
+// queued coverage and crash reports are sent to the server
+// by the sync thread every DEFAULT_SERVER_REPORT_INTERVAL seconds
+#define DEFAULT_SERVER_REPORT_INTERVAL 10
+// how often the sync thread checks for pending work (in ms)
+#define SERVER_SYNC_POLL_INTERVAL 100
+// maximum number of queued coverage and crash reports each, while the
+// server is unreachable. Beyond that the oldest ones are dropped (the
+// coverage of dropped coverage reports is still reported)
+#define MAX_PENDING_SERVER_REPORTS 1000
+
+// announced by threads that currently don't use a corpus view
+#define CORPUS_VIEW_IDLE 0xFFFFFFFFFFFFFFFFULL
+
+// the set of seen path hashes gets reset when it grows above this
+#define MAX_SEEN_PATHS 1000000
+
 class Fuzzer {
 public:
   void Run(int argc, char **argv);
@@ -77,15 +143,36 @@ public:
     int target_argc;
     char **target_argv;
     
-    // a thread-local copy of all samples vector
-    std::vector<Sample *> all_samples_local;
+    // epoch of the corpus view used by this thread
+    // or CORPUS_VIEW_IDLE if it doesn't use any
+    std::atomic<uint64_t> corpus_view_epoch;
+
+    // duration of the last run and the longest run of the
+    // last sample processed in RunSample (both in ms)
+    uint64_t last_exec_time;
+    uint64_t sample_exec_time;
+
+    // hashes of paths whose coverage was already processed
+    // by this thread, used to skip runs with unchanged coverage
+    std::unordered_set<uint64_t> seen_paths;
     
     bool coverage_initialized;
+    // number of entries of coverage_updates applied
+    // to the instrumentation of this thread.
+    // Protected by coverage_mutex
+    size_t coverage_epoch;
 
     ~ThreadContext();
   };
 
   void RunFuzzerThread(ThreadContext *tc);
+  void RunTriageThread(ThreadContext *tc);
+  void RunMinimizeThread(ThreadContext *tc);
+  void RunCminThread(ThreadContext *tc);
+  void RunInputLoaderThread();
+  void RunRestoreThread(ThreadContext *tc);
+  void RunServerSyncThread();
+  void RunLocalSyncThread();
 
 protected:
 
@@ -103,15 +190,22 @@ protected:
     WAIT,
   };
 
+  enum EntryRestoreState {
+    ENTRY_RESTORED,
+    ENTRY_RESTORE_PENDING,
+    ENTRY_RESTORING,
+  };
+
   class SampleQueueEntry {
   public:
     SampleQueueEntry() : sample(NULL), context(NULL),
       priority(0), sample_index(0), num_runs(0),
       num_crashes(0), num_hangs(0), num_newcoverage(0),
-      discarded(0) {}
+      discarded(0), exec_time(0), corpus_index(0), in_use(false),
+      minimized_sample(NULL), minimized_context(NULL), restore_state(ENTRY_RESTORED), restore_offset(0) {}
 
     void Save(FILE *fp);
-    void Load(FILE *fp);
+    void Load(FILE *fp, uint64_t state_version);
     
     Sample *sample;
     std::string sample_filename;
@@ -125,6 +219,24 @@ protected:
     uint64_t num_hangs;
     uint64_t num_newcoverage;
     int32_t discarded;
+    // in ms, used to scale the timeout for slow samples
+    uint64_t exec_time;
+
+    // position of sample in all_samples
+    size_t corpus_index;
+    // set while a fuzzing thread holds the entry
+    bool in_use;
+
+    // prepared by the minimization threads, swapped in for
+    // sample once the entry is no longer being fuzzed
+    Sample *minimized_sample;
+    MutatorSampleContext *minimized_context;
+    std::vector<Range> minimized_ranges;
+
+    // for lazily restored entries, the offset
+    // of the mutator context in the state file
+    int restore_state;
+    uint64_t restore_offset;
   };
   
   struct CmpEntryPtrs
@@ -140,8 +252,59 @@ protected:
 
   std::vector<Sample *> all_samples;
   std::vector<SampleQueueEntry *> all_entries;
+
+  // An immutable copy of all_samples that fuzzing threads pass to
+  // the mutators without locking. Changes to all_samples are published
+  // as a new view the next time a job is handed out, so bursts of new
+  // samples only cost one copy. Replaced views, together with the
+  // samples that were removed from all_samples in the meantime, are
+  // freed once every thread has moved on to a newer view (or doesn't
+  // use any). corpus_epoch is the epoch of the current view and
+  // is only updated after it was published, so that threads can
+  // announce it before touching any view. All but corpus_view and
+  // corpus_epoch are protected by queue_mutex
+  struct CorpusView {
+    uint64_t epoch;
+    std::vector<Sample *> samples;
+  };
+  struct RetiredCorpusView {
+    CorpusView *view;
+    std::vector<Sample *> removed_samples;
+  };
+  std::atomic<CorpusView *> corpus_view;
+  std::atomic<uint64_t> corpus_epoch;
+  bool corpus_view_dirty;
+  std::list<RetiredCorpusView> retired_corpus_views;
+  // fuzzing threads, the only users of corpus views
+  std::vector<ThreadContext *> corpus_readers;
+
+  CorpusView *AcquireCorpusView(ThreadContext *tc);
+  void ReleaseCorpusView(ThreadContext *tc);
+  void PublishCorpusView();
+  void ReclaimCorpusViews();
   std::priority_queue<SampleQueueEntry *, std::vector<SampleQueueEntry *>, CmpEntryPtrs> sample_queue;
   
+  struct CrashTriageJob {
+    Sample *sample;
+    std::string crash_desc;
+    uint32_t init_timeout;
+    uint32_t timeout;
+  };
+
+  struct MinimizationJob {
+    SampleQueueEntry *entry;
+    Sample *sample;
+    Coverage stable_coverage;
+    bool report_to_server;
+    uint32_t init_timeout;
+    uint32_t timeout;
+  };
+
+  struct ServerCoverageReport {
+    Coverage coverage;
+    Sample *sample;
+  };
+
   struct FuzzerJob {
     JobType type;
     union {
@@ -149,6 +312,10 @@ protected:
       SampleQueueEntry* entry;
     };
     bool discard_sample;
+    // for PROCESS_SAMPLE jobs, whether the sample gets reported if it
+    // has new coverage. Input and generated samples are reported so that
+    // the server knows which samples cover what the fuzzer starts from
+    bool report_sample;
   };
 
   void PrintUsage();
@@ -176,11 +343,26 @@ protected:
   
   bool MagicOutputFilter(Sample *original_sample, Sample *output_sample, const char *magic, size_t magic_size);
 
-  void SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout, Sample *original_sample);
+  SampleQueueEntry *SaveSample(ThreadContext *tc, Sample *sample, uint32_t init_timeout, uint32_t timeout, Sample *original_sample);
   RunResult RunSample(ThreadContext *tc, Sample *sample, int *has_new_coverage, bool trim, bool report_to_server, uint32_t init_timeout, uint32_t timeout, Sample *original_sample);
   RunResult RunSampleAndGetCoverage(ThreadContext* tc, Sample* sample, Coverage* coverage, uint32_t init_timeout, uint32_t timeout);
   RunResult TryReproduceCrash(ThreadContext* tc, Sample* sample, uint32_t init_timeout, uint32_t timeout);
+  bool QueueCrashForTriage(Sample *sample, std::string &crash_desc, uint32_t init_timeout, uint32_t timeout);
+  void TriageCrash(ThreadContext *tc, Sample *sample, std::string crash_desc, uint32_t init_timeout, uint32_t timeout);
   void MinimizeSample(ThreadContext *tc, Sample *sample, Coverage* stable_coverage, uint32_t init_timeout, uint32_t timeout);
+  bool CanQueueForMinimization();
+  void QueueForMinimization(SampleQueueEntry *entry, Sample *sample, Coverage *stable_coverage, bool report_to_server, uint32_t init_timeout, uint32_t timeout);
+  void ApplyMinimizedSample(SampleQueueEntry *entry);
+  void AddSeenPath(ThreadContext *tc, uint64_t path_hash);
+
+  void QueueCoverageReport(Coverage *coverage, Sample *sample);
+  void QueueCrashReport(Sample *sample, std::string &crash_desc);
+  void FlushServerReports();
+  void GetServerUpdates();
+
+  void CalibrateTimeout();
+  uint32_t GetSampleTimeout(SampleQueueEntry *entry);
+  uint32_t GetHangConfirmTimeout(uint32_t timeout);
 
   int InterestingSample(ThreadContext *tc, Sample *sample, Coverage *stableCoverage, Coverage *variableCoverage);
 
@@ -196,11 +378,46 @@ protected:
   uint64_t num_samples_discarded;
   uint64_t num_threads;
   uint64_t total_execs;
+  // in microseconds, as reported by the instrumentation
+  uint64_t crash_handling_time;
+  uint64_t num_target_starts;
+  // as of the last status update, reported to the server
+  uint64_t cur_execs_per_sec;
+  uint64_t cur_num_offsets;
   
   void SaveState(ThreadContext *tc);
   void RestoreState(ThreadContext *tc);
   void DumpCoverage();
 
+  // When restoring from a state file in the lazy format, only the
+  // metadata of the queue entries is restored up front. The samples
+  // and mutator contexts are loaded by restore threads in the
+  // background or by the first fuzzing thread that takes the entry
+  // from the queue, whichever comes first. The state file is kept
+  // open until then and the state isn't saved again until all entries
+  // are restored. restore_fp, restore_entries and the restore state
+  // of entries are protected by restore_mutex
+  void EnsureEntryRestored(ThreadContext *tc, SampleQueueEntry *entry);
+  void RestoreEntry(ThreadContext *tc, SampleQueueEntry *entry);
+  Mutex restore_mutex;
+  FILE *restore_fp;
+  bool restore_started;
+  std::vector<SampleQueueEntry *> restore_entries;
+  size_t next_restore_entry;
+  std::atomic<size_t> entries_pending_restore;
+
+  // -cmin mode: runs every sample in the input directory once,
+  // indexes its coverage and writes the smallest / fastest subset
+  // of samples that reaches the same coverage to cmin_dir.
+  // cmin_files and the counters are protected by queue_mutex
+  void MinimizeCorpus(int argc, char **argv);
+  std::string cmin_dir;
+  CorpusIndex *corpus_index;
+  std::vector<std::string> cmin_files;
+  size_t cmin_next_file;
+  size_t cmin_files_done;
+  size_t cmin_files_skipped;
+
   std::string in_dir;
   std::string out_dir;
   std::string delivery_dir;
@@ -215,18 +432,100 @@ protected:
   uint32_t init_timeout;
   uint32_t corpus_timeout;
 
+  bool adaptive_timeout;
+  // the timeout passed via -t, upper bound for adaptive timeouts
+  uint32_t max_timeout;
+  Mutex exec_times_mutex;
+  std::vector<uint64_t> exec_times;
+
   Mutex queue_mutex;
   Mutex output_mutex;
   Mutex coverage_mutex;
 
   Coverage fuzzer_coverage;
 
+  // Coverage added to fuzzer_coverage, in the order it was found.
+  // With incremental coverage, each thread adds the entries found
+  // by other threads to its instrumentation's ignore set before
+  // running a sample, so that coverage found by one thread doesn't
+  // get retried as new by all the others. Entries are dropped once
+  // every fuzzing thread has applied them, coverage_updates_base is
+  // the number of entries dropped so far. Protected by coverage_mutex,
+  // coverage_epoch (the number of entries ever added) can be read
+  // without it
+  struct CoverageUpdate {
+    int thread_id;
+    Coverage coverage;
+  };
+  std::deque<CoverageUpdate> coverage_updates;
+  size_t coverage_updates_base;
+  std::atomic<size_t> coverage_epoch;
+  bool propagate_coverage;
+
+  void ApplyCoverageUpdates(ThreadContext *tc);
+  void TrimCoverageUpdates();
+
+  // execs that didn't have to be spent on retrying coverage
+  // already found by other threads or known to be stable,
+  // and offsets propagated between threads
+  uint64_t num_retries_saved;
+  uint64_t num_propagated_offsets;
+
+  // Stability of every edge seen while retrying samples, kept across
+  // the campaign in stability.dat. An edge is stable if it was present
+  // in every retry and flaky once it was missing from some retry.
+  // Known flaky edges don't count as new coverage and samples whose
+  // new edges are all known to be stable aren't retried.
+  // Protected by coverage_mutex
+  Coverage stable_edges;
+  Coverage flaky_edges;
+  size_t num_stable_edges;
+  size_t num_flaky_edges;
+
+  void UpdateEdgeStability(Coverage &stable, Coverage &variable);
+  void SaveEdgeStability();
+  void LoadEdgeStability();
+
+  // only the server sync thread talks to the server,
+  // fuzzing threads queue reports and pick up new samples
+  // from server_samples_incoming. Samples from other local
+  // instances (-local_sync) arrive through the same queue.
+  // server_mutex is held during network I/O, which can take
+  // arbitrarily long if the server is unreachable
   Mutex server_mutex;
   CoverageClient *server;
   uint64_t last_server_update_time_ms;
   uint64_t server_update_interval_ms;
+  uint64_t server_report_interval_ms;
+
+  Mutex server_queue_mutex;
+  std::list<ServerCoverageReport> server_coverage_reports;
+  // coverage without samples is merged into a single report
+  Coverage server_variable_coverage;
+  std::list<std::pair<Sample *, std::string>> server_crash_reports;
+  std::list<Sample *> server_samples_incoming;
+  bool initial_server_sync_pending;
+
+  LocalSync *local_sync;
+  // set when samples from other instances arrive, so that
+  // fuzzing threads end their rounds early to pick them up
+  std::atomic<bool> local_sync_samples_pending;
+
+  // The input directory is listed and read by loader threads while
+  // the fuzzing threads process the samples that were already read.
+  // Samples with the same contents are only processed once.
+  // Protected by input_mutex, which can be taken while holding
+  // queue_mutex but not the other way around
+  bool InputLoadingDone();
+  int num_input_loader_threads;
+  Mutex input_mutex;
+  DirectoryIterator input_dir_iterator;
+  std::list<std::pair<std::string, Sample *>> input_samples;
+  std::unordered_set<uint64_t> input_hashes;
+  int input_loaders_running;
+  size_t num_inputs_read;
+  size_t num_input_duplicates;
 
-  std::list<std::string> input_files;
   std::list<Sample *> server_samples;
   FuzzerState state;
   size_t samples_pending;
@@ -259,6 +558,30 @@ protected:
   
   Mutex crash_mutex;
   std::unordered_map<std::string, int> unique_crashes;
+
+  // crashes are reproduced, deduplicated and saved
+  // by separate triage threads with their own instrumentation
+  int num_triage_threads;
+  Mutex triage_mutex;
+  std::list<CrashTriageJob> triage_queue;
+  // includes the crashes currently being triaged
+  size_t crashes_pending_triage;
+
+  // new samples found while fuzzing enter the queue unminimized
+  // and are minimized by separate threads with their own
+  // instrumentation. Protected by minimize_mutex
+  int num_minimize_threads;
+  Mutex minimize_mutex;
+  std::list<MinimizationJob> minimize_queue;
+  // includes the samples currently being minimized
+  size_t samples_pending_minimization;
+  uint64_t num_samples_minimized;
+  uint64_t num_bytes_minimized;
+
+  // samples swapped out for their minimized versions. Fuzzing threads
+  // can still reference them through the current corpus view, so they
+  // are only freed together with it. Protected by queue_mutex
+  std::vector<Sample *> replaced_samples;
   
   uint64_t last_save_time;
   
@@ -39,10 +39,23 @@ public:
   virtual void ClearCoverage() = 0;
   virtual void IgnoreCoverage(Coverage &coverage) = 0;
 
+  // returns a hash of the coverage collected during the last run
+  // (computed on GetCoverage), which identifies the path taken.
+  // 0 means path hashing is not supported by the instrumentation
+  virtual uint64_t GetPathHash() { return 0; }
+
+  // time (in microseconds) spent reaping or killing the target
+  // after the last run resulted in a crash or a hang
+  virtual uint64_t GetCrashHandlingTime() { return 0; }
+
+  // number of times the target process was (re)started
+  // during the last run
+  virtual uint32_t GetNumTargetStarts() { return 0; }
+
   virtual std::string GetCrashName() { return "crash"; };
 
   virtual uint64_t GetReturnValue() { return 0; }
 
-  std::string AnonymizeAddress(void* addr);
+  static std::string AnonymizeAddress(void* addr);
 };
 
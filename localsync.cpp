@@ -0,0 +1,194 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <string.h>
+
+#include "common.h"
+#include "localsync.h"
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// the header takes a whole page so that the bitmap is aligned
+#define LOCAL_SYNC_HEADER_SIZE 4096
+#define LOCAL_SYNC_BITMAP_SIZE ((1ULL << LOCAL_SYNC_BITMAP_BITS) / 8)
+
+LocalSync::LocalSync() : header(NULL), bitmap(NULL), log(NULL),
+  log_capacity(0), instance_id(0), read_offset(0), pending_since(0),
+  log_full(false) { }
+
+void LocalSync::Init(const std::string &name, size_t log_size) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  std::string shm_name = std::string("shm_sync_") + name;
+#else
+  std::string shm_name = std::string("/shm_sync_") + name;
+#endif
+
+  log_size = (log_size + 7) & ~(size_t)7;
+  size_t shm_size = LOCAL_SYNC_HEADER_SIZE + LOCAL_SYNC_BITMAP_SIZE + log_size;
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32) && !defined(__ANDROID__)
+  // opening the region resizes it, which would
+  // break the instances that are already running
+  int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+  if (fd != -1) {
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size && ((size_t)st.st_size != shm_size)) {
+      FATAL("Local sync size mismatch, other instances use a different -local_sync_size");
+    }
+    close(fd);
+  }
+#endif
+
+  shm.Open((char *)shm_name.c_str(), shm_size);
+
+  unsigned char *data = shm.GetData();
+  header = (Header *)data;
+  bitmap = (std::atomic<uint64_t> *)(data + LOCAL_SYNC_HEADER_SIZE);
+  log = (char *)(data + LOCAL_SYNC_HEADER_SIZE + LOCAL_SYNC_BITMAP_SIZE);
+
+  // the first instance to get here sets up the header
+  uint64_t magic = 0;
+  if (header->magic.compare_exchange_strong(magic, LOCAL_SYNC_INITIALIZING)) {
+    header->log_capacity = log_size;
+    header->magic.store(LOCAL_SYNC_MAGIC, std::memory_order_release);
+  } else {
+    while ((magic = header->magic.load(std::memory_order_acquire)) == LOCAL_SYNC_INITIALIZING) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(1);
+#else
+      usleep(1000);
+#endif
+    }
+    if (magic != LOCAL_SYNC_MAGIC) {
+      FATAL("Shared memory %s is not a local sync region", shm_name.c_str());
+    }
+    if (header->log_capacity != log_size) {
+      FATAL("Local sync size mismatch, other instances use %llu bytes",
+            (unsigned long long)header->log_capacity);
+    }
+  }
+
+  log_capacity = log_size;
+  instance_id = (uint32_t)(header->next_instance_id.fetch_add(1) + 1);
+
+  printf("Local sync instance %u, %llu bytes of the sample log used\n",
+         instance_id,
+         (unsigned long long)header->log_size.load());
+}
+
+bool LocalSync::SetCoverage(Coverage &coverage) {
+  bool ret = false;
+
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    // FNV-1a, same as for sample hashes
+    uint64_t module_hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < iter->module_name.size(); i++) {
+      module_hash = (module_hash ^ (unsigned char)iter->module_name[i]) * 0x100000001b3ULL;
+    }
+
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      uint64_t bit = ((module_hash ^ *iter2) * 0x9e3779b97f4a7c15ULL) >> (64 - LOCAL_SYNC_BITMAP_BITS);
+      uint64_t mask = 1ULL << (bit % 64);
+      uint64_t old_word = bitmap[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+      if (!(old_word & mask)) ret = true;
+    }
+  }
+
+  return ret;
+}
+
+bool LocalSync::Publish(Sample *sample, Coverage &coverage) {
+  // another instance already published a sample with this coverage
+  if (!SetCoverage(coverage)) return false;
+
+  if (log_full.load(std::memory_order_relaxed)) return false;
+
+  uint64_t entry_size = GetEntrySize(sample->size);
+  uint64_t size_bits = (uint64_t)sample->size << LOCAL_SYNC_SIZE_SHIFT;
+
+  EntryHeader *entry;
+  while (1) {
+    uint64_t offset = header->log_size.load();
+    entry = (EntryHeader *)(log + offset);
+
+    uint64_t state = LOCAL_SYNC_ENTRY_EMPTY;
+    if (offset + entry_size > log_capacity) {
+      // let the readers know they've reached the end
+      if ((offset + sizeof(EntryHeader) > log_capacity) ||
+          entry->state.compare_exchange_strong(state, LOCAL_SYNC_ENTRY_END) ||
+          ((state & LOCAL_SYNC_STATE_MASK) == LOCAL_SYNC_ENTRY_END))
+      {
+        if (!log_full.exchange(true)) {
+          WARN("Local sync sample log is full, new samples won't be shared");
+        }
+        return false;
+      }
+    } else if (entry->state.compare_exchange_strong(state, size_bits | LOCAL_SYNC_ENTRY_PENDING)) {
+      header->log_size.compare_exchange_strong(offset, offset + entry_size);
+      break;
+    }
+
+    // another instance claimed the entry, but
+    // might not have moved the end of the log yet
+    if ((state & LOCAL_SYNC_STATE_MASK) == LOCAL_SYNC_ENTRY_END) return false;
+    header->log_size.compare_exchange_strong(offset,
+      offset + GetEntrySize(state >> LOCAL_SYNC_SIZE_SHIFT));
+  }
+
+  entry->instance_id = instance_id;
+  memcpy((char *)(entry + 1), sample->bytes, sample->size);
+  entry->state.store(size_bits | LOCAL_SYNC_ENTRY_READY, std::memory_order_release);
+
+  return true;
+}
+
+void LocalSync::GetNewSamples(std::list<Sample *> &new_samples) {
+  // entries are read in order, so this stops at an entry that is still
+  // being written even if entries after it are complete. Writing an
+  // entry takes a single memcpy, so readers only wait for long if
+  // the instance writing it was killed, in which case it's skipped
+  while (read_offset + sizeof(EntryHeader) <= log_capacity) {
+    EntryHeader *entry = (EntryHeader *)(log + read_offset);
+    uint64_t state = entry->state.load(std::memory_order_acquire);
+    uint64_t size = state >> LOCAL_SYNC_SIZE_SHIFT;
+
+    if ((state & LOCAL_SYNC_STATE_MASK) == LOCAL_SYNC_ENTRY_EMPTY) break;
+    if ((state & LOCAL_SYNC_STATE_MASK) == LOCAL_SYNC_ENTRY_END) break;
+    if (read_offset + GetEntrySize(size) > log_capacity) break;
+
+    if ((state & LOCAL_SYNC_STATE_MASK) == LOCAL_SYNC_ENTRY_PENDING) {
+      uint64_t cur_time = GetCurTime();
+      if (!pending_since) pending_since = cur_time;
+      if ((cur_time - pending_since) < LOCAL_SYNC_STALE_TIMEOUT) break;
+      WARN("Skipping a local sync sample that was never completely written");
+    } else if (entry->instance_id != instance_id) {
+      Sample *sample = new Sample();
+      sample->Init((char *)(entry + 1), (size_t)size);
+      new_samples.push_back(sample);
+    }
+
+    pending_since = 0;
+    read_offset += GetEntrySize(size);
+  }
+}
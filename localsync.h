@@ -0,0 +1,123 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <list>
+#include <string>
+
+#include "coverage.h"
+#include "sample.h"
+#include "shm.h"
+
+// "LOCLSYN2"
+#define LOCAL_SYNC_MAGIC 0x324e59534c434f4cULL
+// magic value while the first instance sets up the header
+#define LOCAL_SYNC_INITIALIZING 1
+
+// the coverage bitmap has 2^LOCAL_SYNC_BITMAP_BITS bits (2MB)
+#define LOCAL_SYNC_BITMAP_BITS 24
+
+// size of the sample log, in MB
+#define DEFAULT_LOCAL_SYNC_SIZE 256
+
+// how often instances check the log for new samples, in milliseconds
+#define LOCAL_SYNC_POLL_INTERVAL 10
+
+// an entry that is still being written is skipped if it
+// doesn't get completed within this time (in milliseconds),
+// as the instance writing it might have been killed
+#define LOCAL_SYNC_STALE_TIMEOUT 10000
+
+// states of a log entry, kept in the low bits of the
+// entry state, with the sample size above them
+#define LOCAL_SYNC_ENTRY_EMPTY 0
+#define LOCAL_SYNC_ENTRY_PENDING 1
+#define LOCAL_SYNC_ENTRY_READY 2
+// the log is full, nothing follows
+#define LOCAL_SYNC_ENTRY_END 3
+#define LOCAL_SYNC_STATE_MASK 0xFF
+#define LOCAL_SYNC_SIZE_SHIFT 8
+
+// Sync between fuzzer processes on the same machine without
+// a server. All instances that use the same name map a shared
+// memory region holding a coverage bitmap and an append-only log
+// of samples. An instance that finds a sample with new coverage
+// appends it to the log, unless the bitmap shows that all of the
+// coverage was already published by some instance. Other instances
+// poll the log and run the samples they haven't seen yet.
+//
+// The region is zero-initialized by the OS and all-zero is a valid
+// empty state, so instances can start in any order. The region
+// outlives the processes that use it (until it is deleted or, on
+// Windows, all instances exit), so unrelated fuzzing sessions
+// should use different names.
+class LocalSync {
+public:
+  LocalSync();
+
+  // log_size is in bytes
+  void Init(const std::string &name, size_t log_size);
+
+  // coverage is the new coverage of the sample. Returns
+  // true if the sample was appended to the log
+  bool Publish(Sample *sample, Coverage &coverage);
+
+  // appends the samples published by other instances
+  // since the last call. Only called from one thread
+  void GetNewSamples(std::list<Sample *> &new_samples);
+
+protected:
+  struct Header {
+    std::atomic<uint64_t> magic;
+    uint64_t log_capacity;
+    std::atomic<uint64_t> next_instance_id;
+    // end of the claimed entries. An entry is claimed before
+    // this is moved past it, and any instance can move it
+    std::atomic<uint64_t> log_size;
+  };
+
+  struct EntryHeader {
+    // entries are claimed together with their size, so that
+    // readers can skip entries that never get completed
+    std::atomic<uint64_t> state;
+    uint32_t instance_id;
+    uint32_t reserved;
+    // followed by the sample bytes, padded to 8 bytes
+  };
+
+  // sets the bits for the coverage, returns true if any was new
+  bool SetCoverage(Coverage &coverage);
+
+  static uint64_t GetEntrySize(uint64_t sample_size) {
+    return sizeof(EntryHeader) + ((sample_size + 7) & ~(uint64_t)7);
+  }
+
+  SharedMemory shm;
+  Header *header;
+  std::atomic<uint64_t> *bitmap;
+  char *log;
+  uint64_t log_capacity;
+
+  uint32_t instance_id;
+  uint64_t read_offset;
+  // when the reader first found the entry at read_offset pending
+  uint64_t pending_since;
+  std::atomic<bool> log_full;
+};
@@ -0,0 +1,119 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "common.h"
+#include "mappedfile.h"
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+
+MappedFile::MappedFile() {
+  file_handle = INVALID_HANDLE_VALUE;
+  mapping_handle = NULL;
+  size = 0;
+  data = NULL;
+}
+
+bool MappedFile::Open(const char *filename) {
+  Close();
+
+  file_handle = CreateFileA(filename, GENERIC_READ,
+    FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_handle == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_handle, &file_size)) {
+    Close();
+    return false;
+  }
+  size = (size_t)file_size.QuadPart;
+  if (!size) return true;
+
+  mapping_handle = CreateFileMapping(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping_handle == NULL) {
+    Close();
+    return false;
+  }
+
+  data = (char *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, size);
+  if (!data) {
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data) UnmapViewOfFile(data);
+  if (mapping_handle) CloseHandle(mapping_handle);
+  if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+  file_handle = INVALID_HANDLE_VALUE;
+  mapping_handle = NULL;
+  size = 0;
+  data = NULL;
+}
+
+#else
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+MappedFile::MappedFile() {
+  fd = -1;
+  size = 0;
+  data = NULL;
+}
+
+bool MappedFile::Open(const char *filename) {
+  Close();
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    Close();
+    return false;
+  }
+  size = (size_t)st.st_size;
+  if (!size) return true;
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  data = (char *)map;
+
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data) munmap(data, size);
+  if (fd != -1) close(fd);
+  fd = -1;
+  size = 0;
+  data = NULL;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+  Close();
+}
@@ -0,0 +1,49 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+#include "windows.h"
+#endif
+
+// A read-only memory mapping of a whole file.
+// Pages are only read from disk once they are accessed
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  // returns false if the file can't be opened or mapped.
+  // Mapping an empty file succeeds, but GetData() returns NULL
+  bool Open(const char *filename);
+  void Close();
+
+  size_t GetSize() { return size; }
+  const char *GetData() { return data; }
+
+protected:
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  HANDLE file_handle;
+  HANDLE mapping_handle;
+#else
+  int fd;
+#endif
+  size_t size;
+  char *data;
+};
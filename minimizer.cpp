@@ -14,6 +14,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <string.h>
+
 #include "common.h"
 #include "minimizer.h"
 
@@ -38,3 +40,66 @@ void SimpleTrimmer::ReportFail(Sample* sample, MinimizerContext* context) {
   SimpleTrimmerContext* trimmer_context = (SimpleTrimmerContext*)context;
   trimmer_context->trim_step /= 2;
 }
+
+
+static size_t NextPowerOfTwo(size_t size) {
+  size_t ret = 1;
+  while (ret < size) ret <<= 1;
+  return ret;
+}
+
+MinimizerContext* BlockDeletionTrimmer::CreateContext(Sample* sample) {
+  BlockDeletionTrimmerContext* trimmer_context = new BlockDeletionTrimmerContext();
+
+  size_t size_p2 = NextPowerOfTwo(sample->size);
+
+  trimmer_context->block_size = size_p2 / BLOCK_DELETE_START_STEPS;
+  if (trimmer_context->block_size < BLOCK_DELETE_MIN_SIZE) {
+    trimmer_context->block_size = BLOCK_DELETE_MIN_SIZE;
+  }
+  trimmer_context->min_block_size = size_p2 / BLOCK_DELETE_END_STEPS;
+  if (trimmer_context->min_block_size < BLOCK_DELETE_MIN_SIZE) {
+    trimmer_context->min_block_size = BLOCK_DELETE_MIN_SIZE;
+  }
+  trimmer_context->position = 0;
+  trimmer_context->deleted_size = 0;
+
+  return trimmer_context;
+}
+
+int BlockDeletionTrimmer::MinimizeStep(Sample* sample, MinimizerContext* context) {
+  BlockDeletionTrimmerContext* trimmer_context = (BlockDeletionTrimmerContext*)context;
+
+  if (sample->size <= 1) return 0;
+
+  // after a successful deletion, the next block
+  // starts at the same position
+  while (trimmer_context->position >= sample->size) {
+    trimmer_context->block_size /= 2;
+    trimmer_context->position = 0;
+    if (trimmer_context->block_size < trimmer_context->min_block_size) return 0;
+  }
+
+  size_t position = trimmer_context->position;
+  size_t deleted_size = trimmer_context->block_size;
+  if (deleted_size > sample->size - position) {
+    deleted_size = sample->size - position;
+  }
+  // don't delete the entire sample
+  if (deleted_size == sample->size) {
+    deleted_size = sample->size - 1;
+  }
+
+  memmove(sample->bytes + position,
+          sample->bytes + position + deleted_size,
+          sample->size - position - deleted_size);
+  sample->Trim(sample->size - deleted_size);
+
+  trimmer_context->deleted_size = deleted_size;
+  return 1;
+}
+
+void BlockDeletionTrimmer::ReportFail(Sample* sample, MinimizerContext* context) {
+  BlockDeletionTrimmerContext* trimmer_context = (BlockDeletionTrimmerContext*)context;
+  trimmer_context->position += trimmer_context->deleted_size;
+}
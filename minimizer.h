@@ -41,6 +41,30 @@ public:
 };
 
 class SimpleTrimmer : public Minimizer {
+public:
+  virtual MinimizerContext* CreateContext(Sample* sample);
+  virtual int MinimizeStep(Sample* sample, MinimizerContext* context);
+  virtual void ReportFail(Sample* sample, MinimizerContext* context);
+};
+
+// AFL-style block deletion. Blocks are deleted from anywhere in the
+// sample, starting with 1/BLOCK_DELETE_START_STEPS of the sample size
+// (rounded up to a power of two) and halving the block size after
+// each pass, down to 1/BLOCK_DELETE_END_STEPS of the sample size
+#define BLOCK_DELETE_START_STEPS 16
+#define BLOCK_DELETE_END_STEPS 1024
+#define BLOCK_DELETE_MIN_SIZE 4
+
+class BlockDeletionTrimmerContext : public MinimizerContext {
+public:
+  size_t block_size;
+  size_t min_block_size;
+  size_t position;
+  // size of the last deleted block
+  size_t deleted_size;
+};
+
+class BlockDeletionTrimmer : public Minimizer {
 public:
   virtual MinimizerContext* CreateContext(Sample* sample);
   virtual int MinimizeStep(Sample* sample, MinimizerContext* context);
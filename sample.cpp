@@ -204,6 +204,15 @@ void SampleTrie::SampleTrieNode::InitConstantPart(Sample *sample,
   memcpy(constant_part, sample->bytes + from, constant_part_size);
 }
 
+uint64_t Sample::GetHash() {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
 size_t SampleTrie::AddSample(Sample *sample) {
   if(sample->size == 0) return 0;
   
@@ -281,3 +290,29 @@ size_t SampleTrie::AddSample(Sample *sample) {
   
   sample_trie_mutex.Unlock();
 }
+
+void SampleBloomFilter::Init(size_t num_elements) {
+  size_t num_bits = BLOOM_FILTER_MIN_BITS;
+  while (num_bits < num_elements * BLOOM_FILTER_BITS_PER_ELEMENT) num_bits *= 2;
+  bits.assign(num_bits / 64, 0);
+}
+
+void SampleBloomFilter::Add(uint64_t hash) {
+  uint64_t num_bits = bits.size() * 64;
+  uint64_t h2 = (hash >> 32) | 1;
+  for (int i = 0; i < BLOOM_FILTER_NUM_HASHES; i++) {
+    uint64_t bit = (hash + i * h2) & (num_bits - 1);
+    bits[bit / 64] |= (1ULL << (bit % 64));
+  }
+}
+
+bool SampleBloomFilter::Contains(uint64_t hash) {
+  uint64_t num_bits = bits.size() * 64;
+  if (!num_bits) return false;
+  uint64_t h2 = (hash >> 32) | 1;
+  for (int i = 0; i < BLOOM_FILTER_NUM_HASHES; i++) {
+    uint64_t bit = (hash + i * h2) & (num_bits - 1);
+    if (!(bits[bit / 64] & (1ULL << (bit % 64)))) return false;
+  }
+  return true;
+}
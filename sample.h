@@ -17,8 +17,10 @@ limitations under the License.
 #pragma once
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
 #include "mutex.h"
 
@@ -62,6 +64,10 @@ public:
 
   size_t FindFirstDiff(Sample &other);
 
+  // hash of the sample contents, used to identify
+  // identical samples across fuzzers
+  uint64_t GetHash();
+
   static size_t max_size;
 };
 
@@ -94,3 +100,20 @@ protected:
   SampleTrieNode *root;
 };
 
+// bits per element, gives a false positive rate of about 0.05%
+#define BLOOM_FILTER_BITS_PER_ELEMENT 16
+#define BLOOM_FILTER_MIN_BITS 1024
+#define BLOOM_FILTER_NUM_HASHES 8
+
+// a set of sample hashes compact enough to be sent over the network.
+// Contains() can return false positives but no false negatives
+class SampleBloomFilter {
+public:
+  void Init(size_t num_elements);
+
+  void Add(uint64_t hash);
+  bool Contains(uint64_t hash);
+
+  // size is always a power of two
+  std::vector<uint64_t> bits;
+};
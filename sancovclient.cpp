@@ -24,6 +24,8 @@ limitations under the License.
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
 
 #include "sancovclient.h"
 
@@ -66,6 +68,56 @@ void __sanitizer_cov_reset_edgeguards() {
 extern char **environ;
 bool fuzzer = false;
 
+static const int fault_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+#define NUM_FAULT_SIGNALS (sizeof(fault_signals) / sizeof(fault_signals[0]))
+static struct sigaction old_actions[NUM_FAULT_SIGNALS];
+
+static uint64_t get_fault_pc(void *context) {
+    ucontext_t *uc = (ucontext_t *)context;
+#if defined(__x86_64__)
+    return (uint64_t)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+    return (uint64_t)uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+    return (uint64_t)uc->uc_mcontext.pc;
+#else
+    return 0;
+#endif
+}
+
+// Reports the signal and the faulting pc to the fuzzer so that
+// crashes can be deduplicated without a core dump, then lets the
+// previous handler (e.g. ASAN's) or the default action take over
+static void fault_handler(int sig, siginfo_t *info, void *context) {
+    for (size_t i = 0; i < NUM_FAULT_SIGNALS; i++) {
+        if (fault_signals[i] != sig) continue;
+        sigaction(sig, &old_actions[i], NULL);
+    }
+
+    char status = 'x';
+    uint32_t signal = sig;
+    uint64_t pc = get_fault_pc(context);
+    if (write(FUZZ_CHILD_CTRL_OUT, &status, 1) == 1 &&
+        write(FUZZ_CHILD_CTRL_OUT, &signal, sizeof(signal)) == sizeof(signal)) {
+        write(FUZZ_CHILD_CTRL_OUT, &pc, sizeof(pc));
+    }
+
+    // synchronous signals fault again when the handler returns;
+    // anything else needs to be raised again
+    if (info->si_code <= 0) raise(sig);
+}
+
+static void install_fault_handlers() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < NUM_FAULT_SIGNALS; i++) {
+        sigaction(fault_signals[i], &sa, &old_actions[i]);
+    }
+}
+
 extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
     // Avoid duplicate initialization
     if (start == stop || *start)
@@ -101,6 +153,8 @@ extern "C" void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *s
 
     __sanitizer_cov_reset_edgeguards();
 
+    if (fuzzer) install_fault_handlers();
+
     cov_shmem->num_edges = stop - start;
     printf("[COV] edge counters initialized. Shared memory: %s with %u edges\n", shm_key, cov_shmem->num_edges);
 }
@@ -21,6 +21,7 @@ limitations under the License.
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -38,16 +39,30 @@ limitations under the License.
 
 extern char **environ;
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 #define COVERAGE_SHM_SIZE 0x100000
 #define MAX_EDGES ((SHM_SIZE - 4) * 8)
 
 #define unlikely(cond) __builtin_expect(!!(cond), 0)
 
+#define PATH_HASH_SEED 0xcbf29ce484222325ULL
+#define PATH_HASH_PRIME 0x100000001b3ULL
+#define PATH_HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
 SanCovInstrumentation::SanCovInstrumentation(int thread_id) {
   this->thread_id = thread_id;
   cov_shm = NULL;
   pid = 0;
+  pidfd = -1;
   return_value = 0;
+  path_hash = 0;
+  crash_handling_time = 0;
+  num_target_starts = 0;
+  fault_signal = 0;
+  fault_pc = 0;
   module_name = "target";
 }
 
@@ -69,6 +84,7 @@ void SanCovInstrumentation::Init(int argc, char **argv) {
   std::string asan_report_dir = DirJoin(out_dir, "ASAN");
   CreateDirectory(asan_report_dir);
   asan_report_file = DirJoin(asan_report_dir, "log");
+  stack_hash_frames = GetIntOption("-stack_hash_frames", argc, argv, DEFAULT_STACK_HASH_FRAMES);
 
   // compute shm names
   sample_shm_name = std::string("/shm_fuzz_") + std::to_string(getpid()) + "_" + std::to_string(thread_id);
@@ -161,6 +177,8 @@ void SanCovInstrumentation::StartTarget(int argc, char** argv) {
   int crpipe[2] = { 0, 0 };          // control pipe child -> reprl
   int cwpipe[2] = { 0, 0 };          // control pipe reprl -> child
 
+  num_target_starts++;
+
   if (pipe(crpipe) != 0) {
     FATAL("Error creating pipe");
   }
@@ -218,6 +236,10 @@ void SanCovInstrumentation::StartTarget(int argc, char** argv) {
   }
   
   this->pid = pid;
+
+  // pidfd becomes readable when the child exits, which lets us
+  // wait for the exit and the control pipe in a single poll()
+  pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
   
   cur_iteration = 0;
 }
@@ -227,6 +249,27 @@ void SanCovInstrumentation::CleanupChild() {
     pid = 0;
     close(ctrl_in);
     close(ctrl_out);
+    if (pidfd >= 0) {
+      close(pidfd);
+      pidfd = -1;
+    }
+}
+
+bool SanCovInstrumentation::ReapChild(uint32_t timeout, int *status) {
+  if (pidfd >= 0) {
+    struct pollfd fds = {.fd = pidfd, .events = POLLIN, .revents = 0};
+    if (poll(&fds, 1, timeout) != 1) return false;
+    // the child has exited at this point so this doesn't block
+    return waitpid(pid, status, 0) == pid;
+  }
+
+  // no pidfd support, fall back to polling waitpid
+  size_t retries = (timeout * 10);
+  for(size_t i = 0; i < retries; i++) {
+    if(waitpid(pid, status, WNOHANG) == pid) return true;
+    usleep(100);
+  }
+  return false;
 }
 
 void SanCovInstrumentation::Kill() {
@@ -238,22 +281,35 @@ void SanCovInstrumentation::Kill() {
 }
 
 RunResult SanCovInstrumentation::GetStatus(uint32_t timeout, int expected_status) {
-  struct pollfd fds = {.fd = ctrl_in, .events = POLLIN, .revents = 0};
-  int res = poll(&fds, 1, timeout);
+  struct pollfd fds[2];
+  fds[0] = {.fd = ctrl_in, .events = POLLIN, .revents = 0};
+  fds[1] = {.fd = pidfd, .events = POLLIN, .revents = 0};
+  nfds_t nfds = (pidfd >= 0) ? 2 : 1;
+
+  int res = poll(fds, nfds, timeout);
   if (res == 0) return HANG;
-  else if (res != 1) return OTHER_ERROR;
+  else if (res < 0) return OTHER_ERROR;
+
+  // control pipe closed or the child exited without reporting
+  if (!(fds[0].revents & POLLIN)) return CRASH;
   
   int status = 0;
   ssize_t rv = read(ctrl_in, &status, 1);
   if(rv < 0) return OTHER_ERROR;
   else if(rv != 1) return CRASH;
+
+  // the target is reporting a fatal signal
+  if(status == 'x') {
+    ReadFaultInfo(&fds[0], timeout);
+    return CRASH;
+  }
   
   if(status != expected_status) {
     return OTHER_ERROR;
   }
   
   if(status == 'd') {  
-    res = poll(&fds, 1, timeout);
+    res = poll(fds, 1, timeout);
     if (res != 1) return OTHER_ERROR;
   
     uint64_t return_value;
@@ -266,6 +322,21 @@ RunResult SanCovInstrumentation::GetStatus(uint32_t timeout, int expected_status
   return OK;  
 }
 
+bool SanCovInstrumentation::ReadFaultInfo(struct pollfd *fd, uint32_t timeout) {
+  // followed by the signal number and the faulting pc
+  uint32_t signal;
+  uint64_t pc;
+
+  if(poll(fd, 1, timeout) != 1) return false;
+  if(read(ctrl_in, &signal, sizeof(signal)) != sizeof(signal)) return false;
+  if(poll(fd, 1, timeout) != 1) return false;
+  if(read(ctrl_in, &pc, sizeof(pc)) != sizeof(pc)) return false;
+
+  fault_signal = signal;
+  fault_pc = pc;
+  return true;
+}
+
 RunResult SanCovInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
   if (cur_iteration == num_iterations) {
     Kill();
@@ -273,6 +344,10 @@ RunResult SanCovInstrumentation::Run(int argc, char **argv, uint32_t init_timeou
 
   RunResult poll_result;
 
+  fault_signal = 0;
+  fault_pc = 0;
+  num_target_starts = 0;
+
   if(!pid) {
     StartTarget(argc, argv);
   } else {
@@ -294,43 +369,55 @@ RunResult SanCovInstrumentation::Run(int argc, char **argv, uint32_t init_timeou
   write(ctrl_out, "c", 1);
   
   poll_result = GetStatus(timeout, 'd');
+
+  crash_handling_time = 0;
   
   if(poll_result == OK) {
     cur_iteration++;
     return OK;
-  } else if(poll_result == CRASH) {
-    // try getting the exit status
-    // (potentially multiple times)
-    size_t retries = (timeout * 10);
-    int success = 0;
+  }
+
+  uint64_t handling_start = GetTimeUs();
+  RunResult result = HandleFailedRun(poll_result, timeout);
+  crash_handling_time = GetTimeUs() - handling_start;
+
+  return result;
+}
+
+RunResult SanCovInstrumentation::HandleFailedRun(RunResult poll_result, uint32_t timeout) {
+  // crash names must not contain anything run-specific
+  // (such as timestamps), otherwise they can't be deduplicated
+  if(poll_result == CRASH) {
+    // get the exit status
     int status;
     int crashpid = pid;
-    for(size_t i = 0; i < retries; i++) {
-       success = waitpid(pid, &status, WNOHANG) == pid;
-       if(success) break;
-       usleep(100);
-    }
-    if(!success) {
-      crash_description = std::string("unexpected_error_") + GetTimeStr();
+    if(!ReapChild(timeout, &status)) {
+      crash_description = "unexpected_error";
       Kill();
       return CRASH;
     }
     CleanupChild();
     if(WIFSIGNALED(status)) {
       int signal = WTERMSIG(status);
-      crash_description = std::string("signal_") + std::to_string(signal) + std::string("_") + GetTimeStr();
+      crash_description = std::string("signal_") + std::to_string(signal);
+      if(fault_signal == signal) {
+        crash_description += std::string("_") + AnonymizeAddress((void *)fault_pc);
+      }
       return CRASH;
     } else if (WIFEXITED(status) && (WEXITSTATUS(status) == ASAN_EXIT_STATUS)) {
       crash_description = GetAsanCrashDesc(crashpid);
       return CRASH;
     }
-    crash_description = std::string("unexpected_exit_") + GetTimeStr();
+    crash_description = "unexpected_exit";
+    if(WIFEXITED(status)) {
+      crash_description += std::string("_") + std::to_string(WEXITSTATUS(status));
+    }
     return CRASH;
   } else if (poll_result == HANG) {
     Kill();
     return HANG;
   } else {
-    crash_description = std::string("unexpected_error_") + GetTimeStr();
+    crash_description = "unexpected_error";
     Kill();
     return CRASH;
   }
@@ -344,12 +431,10 @@ std::string SanCovInstrumentation::GetCrashName() {
   return crash_description;
 }
 
-std::string SanCovInstrumentation::GetTimeStr() {
-  uint64_t time;
+uint64_t SanCovInstrumentation::GetTimeUs() {
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
-  time = ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
-  return std::to_string(time);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 
@@ -359,22 +444,37 @@ void SanCovInstrumentation::GetCoverage(Coverage &coverage, bool clear_coverage)
   uint64_t* current = (uint64_t*)cov_shm->edges;
   uint64_t* end = (uint64_t*)(cov_shm->edges + ((cov_shm->num_edges + 7) / 8));
   uint64_t* virgin = (uint64_t*)virgin_bits;
-  
+
+  // the path hash is computed over the touched words only
+  // in the same pass that looks for new edges
+  uint64_t hash = PATH_HASH_SEED;
+
   while (current < end) {
-    if (*current && unlikely(*current & *virgin)) {
-      // New edge(s) found!
-      uint64_t index = ((uintptr_t)current - (uintptr_t)cov_shm->edges) * 8;
-      for (uint64_t i = index; i < index + 64; i++) {
-        if (edge(cov_shm->edges, i) == 1 && edge(virgin_bits, i) == 1) {
-          new_offsets.insert(i);
+    if (*current) {
+      uint64_t word_index = current - (uint64_t*)cov_shm->edges;
+      hash = (hash ^ (*current + word_index * PATH_HASH_MULTIPLIER)) * PATH_HASH_PRIME;
+
+      if (unlikely(*current & *virgin)) {
+        // New edge(s) found!
+        uint64_t index = word_index * 64;
+        for (uint64_t i = index; i < index + 64; i++) {
+          if (edge(cov_shm->edges, i) == 1 && edge(virgin_bits, i) == 1) {
+            new_offsets.insert(i);
+          }
         }
       }
+
+      // clearing only the touched words is cheaper than
+      // clearing the entire bitmap
+      if (clear_coverage) *current = 0;
     }
 
     current++;
     virgin++;
   }
 
+  path_hash = hash;
+
   if(new_offsets.empty()) return;
   
   ModuleCoverage *target_coverage = GetModuleCoverage(coverage, module_name);
@@ -383,8 +483,6 @@ void SanCovInstrumentation::GetCoverage(Coverage &coverage, bool clear_coverage)
   } else {
     target_coverage->offsets.insert(new_offsets.begin(), new_offsets.end());
   }
-
-  if(clear_coverage) ClearCoverage();  
 }
 
 bool SanCovInstrumentation::HasNewCoverage() {
@@ -408,44 +506,28 @@ void SanCovInstrumentation::IgnoreCoverage(Coverage &coverage) {
 }
 
 std::string SanCovInstrumentation::GetAsanCrashDesc(int crashpid) {
-  // very basic parsing of ASAN crash report
   std::string filename = asan_report_file + "." + std::to_string(crashpid);
   FILE *fp = fopen(filename.c_str(), "rb");
   if(!fp) {
     WARN("Error opening ASAN report at %s", filename.c_str());
-    return std::string("ASAN_") + GetTimeStr();
+    return std::string("ASAN_unknown");
   }
   fseek(fp, 0, SEEK_END);
   size_t size = ftell(fp);
   fseek(fp, 0, SEEK_SET);
   char *buf = (char *)malloc(size + 1);
-  fread(buf, 1, size, fp);
+  size = fread(buf, 1, size, fp);
   buf[size] = 0;
   fclose(fp);
   
   unlink(filename.c_str());
-  
-  std::string reason;
-  if(strstr(buf, "AddressSanitizer: stack-overflow on address")) {
-    reason = "stack-overflow_";
-  }  
-  
-  char *pc = strstr(buf, "pc 0x");
-  if(!pc) {
+
+  CrashSignature signature;
+  if(!signature.ParseSanitizerReport(buf, stack_hash_frames)) {
     free(buf);
-    return std::string("ASAN_") + reason + GetTimeStr();
+    return std::string("ASAN_unknown");
   }
 
-  char *hex = pc + 3;
-  char *hexend = hex + 2;
-  while(isalnum(*hexend)) hexend++;
-  *hexend = 0;
-
-  unsigned long addres = strtoul(hex, NULL, 16);
-
-  free(buf);  
-  return std::string("ASAN_") + reason + AnonymizeAddress((void *)addres);
+  free(buf);
+  return signature.GetName("ASAN");
 }
-
-
-
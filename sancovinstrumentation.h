@@ -22,6 +22,7 @@ limitations under the License.
 #include "coverage.h"
 #include "runresult.h"
 #include "instrumentation.h"
+#include "crashsignature.h"
 
 class SanCovInstrumentation : public Instrumentation {
 public:
@@ -39,6 +40,12 @@ public:
   void ClearCoverage() override;
   void IgnoreCoverage(Coverage &coverage) override;
 
+  uint64_t GetPathHash() override { return path_hash; }
+
+  uint64_t GetCrashHandlingTime() override { return crash_handling_time; }
+
+  uint32_t GetNumTargetStarts() override { return num_target_starts; }
+
   uint64_t GetReturnValue() override { return return_value; }
 
   std::string GetCrashName() override;
@@ -63,18 +70,32 @@ protected:
   void StartTarget(int argc, char** argv);
   void Kill();
   void CleanupChild();
+  bool ReapChild(uint32_t timeout, int *status);
   
   RunResult GetStatus(uint32_t timeout, int expected_status);
+  bool ReadFaultInfo(struct pollfd *fd, uint32_t timeout);
+  RunResult HandleFailedRun(RunResult poll_result, uint32_t timeout);
   
   std::string GetAsanCrashDesc(int crashpid);
   
-  std::string GetTimeStr();
+  uint64_t GetTimeUs();
   
   uint64_t return_value;
+  uint64_t path_hash;
+  uint64_t crash_handling_time;
+  uint32_t num_target_starts;
   std::string crash_description; 
   std::string asan_report_file;
+  int stack_hash_frames;
+
+  // reported by the signal handler in the target
+  // before it dies, 0 if not reported
+  int fault_signal;
+  uint64_t fault_pc;
 
   int pid;
+  // -1 if pidfd_open isn't supported by the kernel
+  int pidfd;
   int thread_id;
   
   std::string sample_shm_name;
@@ -20,6 +20,19 @@ limitations under the License.
 #include "directory.h"
 #include "common.h"
 #include "thread.h"
+#include "wire.h"
+#include "compression.h"
+#include "client.h"
+
+#include <time.h>
+#include <algorithm>
+#include <queue>
+
+#ifdef linux
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
 
 int ServerCommon::Read(socket_type sock, void *buf, size_t size) {
   int ret;
@@ -56,7 +69,7 @@ int ServerCommon::Write(socket_type sock, const char *buf, size_t size) {
     } else {
       write_chunk = (int)to_write;
     }
-    ret = send(sock, p, write_chunk, 0);
+    ret = send(sock, p, write_chunk, SEND_FLAGS);
     //printf("read returned %ld\n", ret);
     if (ret > 0) {
       to_write -= ret;
@@ -81,14 +94,12 @@ int ServerCommon::RecvSample(socket_type sock, Sample &sample) {
   if (!Read(sock, &sample_size, sizeof(sample_size))) {
     return 0;
   }
-  char *new_bytes = (char*)malloc(sample_size);
-  if (!new_bytes) return 0;
-  if (!Read(sock, new_bytes, sample_size)) {
-    free(new_bytes);
+  // read directly into the sample
+  sample.Init((size_t)sample_size);
+  if (sample_size && !sample.bytes) return 0;
+  if (!Read(sock, sample.bytes, sample_size)) {
     return 0;
   }
-  sample.Init(new_bytes, (size_t)sample_size);
-  free(new_bytes);
   return 1;
 }
 
@@ -116,6 +127,8 @@ int ServerCommon::RecvString(socket_type sock, std::string &str) {
 }
 
 int ServerCommon::SendCoverage(socket_type sock, Coverage &coverage) {
+  WireWriter writer;
+
   for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
     uint64_t num_offsets = iter->offsets.size();
     uint64_t *offsets = (uint64_t *)malloc(num_offsets * sizeof(uint64_t));
@@ -126,17 +139,18 @@ int ServerCommon::SendCoverage(socket_type sock, Coverage &coverage) {
       i++;
     }
 
-    send(sock, "C", 1, 0);
-    SendString(sock, iter->module_name);
-    send(sock, (char *)&num_offsets, sizeof(num_offsets), 0);
-    send(sock, (char *)offsets, (int)(num_offsets * sizeof(uint64_t)), 0);
+    writer.AppendByte('C');
+    writer.AppendU64(iter->module_name.size());
+    writer.Append(iter->module_name.data(), iter->module_name.size());
+    writer.AppendU64(num_offsets);
+    writer.Append(offsets, num_offsets * sizeof(uint64_t));
 
     free(offsets);
   }
   
-  send(sock, "N", 1, 0);
+  writer.AppendByte('N');
 
-  return 1;
+  return writer.Flush(sock);
 }
 
 int ServerCommon::RecvCoverage(socket_type sock, Coverage &coverage) {
@@ -188,6 +202,135 @@ int ServerCommon::RecvCoverage(socket_type sock, Coverage &coverage) {
   return 1;
 }
 
+void ServerCommon::AppendSampleV2(WireWriter &writer, Sample &sample, bool compress) {
+  AppendSampleV2(writer, sample.bytes, sample.size, compress);
+}
+
+void ServerCommon::AppendSampleV2(WireWriter &writer, const char *bytes, size_t size, bool compress) {
+  if (compress && size) {
+    std::string compressed;
+    Compress(bytes, size, compressed);
+    if (compressed.size() < size) {
+      writer.AppendByte(WIRE_SAMPLE_COMPRESSED);
+      writer.AppendU64(size);
+      writer.AppendU64(compressed.size());
+      writer.Append(compressed.data(), compressed.size());
+      return;
+    }
+  }
+
+  writer.AppendByte(0);
+  writer.AppendU64(size);
+  writer.AppendU64(size);
+  writer.AppendRef(bytes, size);
+}
+
+int ServerCommon::RecvSampleV2(socket_type sock, Sample &sample) {
+  char flags;
+  uint64_t sample_size, payload_size;
+
+  if (!Read(sock, &flags, 1)) return 0;
+  if (!Read(sock, &sample_size, sizeof(sample_size))) return 0;
+  if (!Read(sock, &payload_size, sizeof(payload_size))) return 0;
+
+  if (!(flags & WIRE_SAMPLE_COMPRESSED)) {
+    if (payload_size != sample_size) return 0;
+    sample.Init((size_t)sample_size);
+    if (sample_size && !sample.bytes) return 0;
+    return Read(sock, sample.bytes, sample_size);
+  }
+
+  if (payload_size > MaxCompressedSize((size_t)sample_size)) return 0;
+
+  char *payload = (char *)malloc(payload_size);
+  if (payload_size && !payload) return 0;
+  if (!Read(sock, payload, payload_size)) {
+    free(payload);
+    return 0;
+  }
+
+  sample.Init((size_t)sample_size);
+  if (sample_size && !sample.bytes) {
+    free(payload);
+    return 0;
+  }
+  bool ret = Decompress(payload, (size_t)payload_size, sample.bytes, sample.size);
+  free(payload);
+  return ret ? 1 : 0;
+}
+
+void ServerCommon::AppendCoverageV2(WireWriter &writer, Coverage &coverage) {
+  std::string encoded;
+  EncodeCoverage(coverage, encoded);
+  writer.AppendU64(encoded.size());
+  writer.Append(encoded.data(), encoded.size());
+}
+
+int ServerCommon::RecvCoverageV2(socket_type sock, Coverage &coverage) {
+  uint64_t size;
+  if (!Read(sock, &size, sizeof(size))) return 0;
+  if (size > MAX_COVERAGE_WIRE_SIZE) return 0;
+
+  char *encoded = (char *)malloc(size);
+  if (size && !encoded) return 0;
+  if (!Read(sock, encoded, size)) {
+    free(encoded);
+    return 0;
+  }
+
+  bool ret = DecodeCoverage(encoded, (size_t)size, coverage);
+  free(encoded);
+  return ret ? 1 : 0;
+}
+
+CoverageServer::ServerCorpus::ServerCorpus() : num_entries(0) {
+  segments.resize(MAX_CORPUS_SEGMENTS, NULL);
+}
+
+CoverageServer::ServerCorpus::~ServerCorpus() {
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (segments[i]) delete [] segments[i];
+  }
+}
+
+CoverageServer::ServerCorpus::Entry *CoverageServer::ServerCorpus::GetNextEntry() {
+  // there is only ever one writer, so the size can't change under us
+  size_t index = num_entries.load(std::memory_order_relaxed);
+  size_t segment = index / CORPUS_SEGMENT_SIZE;
+  if (segment >= MAX_CORPUS_SEGMENTS) {
+    FATAL("Server corpus full");
+  }
+  if (!segments[segment]) {
+    segments[segment] = new Entry[CORPUS_SEGMENT_SIZE];
+  }
+
+  return &segments[segment][index % CORPUS_SEGMENT_SIZE];
+}
+
+void CoverageServer::ServerCorpus::Publish() {
+  // publish the entry only after it was fully written
+  size_t index = num_entries.load(std::memory_order_relaxed);
+  num_entries.store(index + 1, std::memory_order_release);
+}
+
+void CoverageServer::ServerCorpus::Append(Sample &sample, SampleInfo &info, Coverage *coverage) {
+  Entry *entry = GetNextEntry();
+  entry->sample = sample;
+  entry->bytes = entry->sample.bytes;
+  entry->size = entry->sample.size;
+  entry->info = info;
+  if (coverage) entry->coverage = *coverage;
+  Publish();
+}
+
+void CoverageServer::ServerCorpus::AppendMapped(const char *bytes, size_t size, SampleInfo &info) {
+  Entry *entry = GetNextEntry();
+  entry->bytes = bytes;
+  entry->size = size;
+  entry->info = info;
+  Publish();
+}
+
 uint64_t CoverageServer::GetIndex(std::vector<TimestampIndex> &timestamps, uint64_t timestamp, uint64_t last_index) {
   if (timestamp == 0) return 0;
   if (timestamps.empty()) return 0;
@@ -221,7 +364,7 @@ uint64_t CoverageServer::GetIndex(std::vector<TimestampIndex> &timestamps, uint6
   return timestamps[m].index;
 }
 
-int CoverageServer::ServeUpdates(socket_type sock) {
+int CoverageServer::ServeUpdates(socket_type sock, int wire_version) {
   uint64_t timestamp;
   uint64_t client_id, client_execs;
 
@@ -239,75 +382,188 @@ int CoverageServer::ServeUpdates(socket_type sock) {
     return 0;
   }
 
+  // hashes of the samples the client already has
+  SampleBloomFilter known_samples;
+  if (wire_version >= 3) {
+    uint64_t num_words;
+    if (!Read(sock, &num_words, sizeof(num_words))) {
+      return 0;
+    }
+    if ((num_words > MAX_BLOOM_FILTER_WORDS) || (num_words & (num_words - 1))) {
+      return 0;
+    }
+    known_samples.bits.resize((size_t)num_words);
+    if (num_words && !Read(sock, &known_samples.bits[0], num_words * sizeof(uint64_t))) {
+      return 0;
+    }
+  }
+
+  // older clients only send their total execs
+  ClientStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.total_execs = client_execs;
+  if (wire_version >= 4) {
+    uint64_t stats_size;
+    if (!Read(sock, &stats_size, sizeof(stats_size))) {
+      return 0;
+    }
+    if (!stats_size || (stats_size > MAX_CLIENT_STATS_SIZE)) {
+      return 0;
+    }
+    std::string encoded_stats((size_t)stats_size, 0);
+    if (!Read(sock, &encoded_stats[0], (size_t)stats_size)) {
+      return 0;
+    }
+    if (!DecodeClientStats(encoded_stats.data(), encoded_stats.size(), stats)) {
+      return 0;
+    }
+  }
+  fleet_stats.AddClientStats(client_id, stats, wire_version >= 4);
+
+  // the whole reply is buffered and sent with as few
+  // system calls as possible. Sample bytes are sent
+  // directly from the corpus
+  WireWriter writer;
+
+  // only the snapshot is taken under the lock. Published corpus
+  // entries never change, so the samples can be sent after the
+  // lock is released and writers never wait on the network
   mutex.LockRead();
 
-  Write(sock, (const char *)(&server_timestamp), sizeof(server_timestamp));
+  uint64_t snapshot_timestamp = server_timestamp;
+  size_t snapshot_size = corpus.GetSize();
 
-  if (timestamp >= server_timestamp) {
-    send(sock, "N", 1, 0);
-    mutex.UnlockRead();
-    return 1;
+  uint64_t first_index = snapshot_size;
+  if (timestamp < snapshot_timestamp) {
+    first_index = GetIndex(corpus.timestamps, timestamp, snapshot_size);
   }
 
-  uint64_t first_index = GetIndex(corpus.timestamps, timestamp, corpus.samples.size());
-  if (first_index >= corpus.samples.size()) {
-    send(sock, "N", 1, 0);
-    mutex.UnlockRead();
-    return 1;
+  mutex.UnlockRead();
+
+  // clients starting from scratch get the distilled corpus
+  // followed by the samples added after the distillation
+  std::vector<size_t> distilled;
+  if (timestamp == 0) {
+    distill_mutex.Lock();
+    if (distilled_size && (distilled_size <= snapshot_size)) {
+      distilled = distilled_samples;
+      first_index = distilled_size;
+    }
+    distill_mutex.Unlock();
   }
 
-  for (size_t i = first_index; i < corpus.samples.size(); i++) {
-    Sample &sample = corpus.samples[i];
-    send(sock, "S", 1, 0);
+  writer.AppendU64(snapshot_timestamp);
 
-    if (!SendSample(sock, sample)) {
-      mutex.UnlockRead();
-      return 0;
+  size_t num_distilled = distilled.size();
+  size_t num_entries = num_distilled + (size_t)(snapshot_size - first_index);
+  for (size_t i = 0; i < num_entries; i++) {
+    size_t index = (i < num_distilled) ? distilled[i] : (size_t)first_index + (i - num_distilled);
+    ServerCorpus::Entry *entry = corpus.Get(index);
+    SampleInfo &info = entry->info;
+
+    // skip the client's own samples and the ones
+    // it got from elsewhere (e.g. its input directory)
+    if (wire_version >= 2) {
+      if (info.client_id == client_id) continue;
+      if (known_samples.Contains(info.hash)) continue;
+    }
+
+    writer.AppendByte('S');
+    if (wire_version >= 2) {
+      AppendSampleV2(writer, entry->bytes, entry->size, compress_samples);
+    } else {
+      writer.AppendU64(entry->size);
+      writer.AppendRef(entry->bytes, entry->size);
+    }
+    if (wire_version >= 5) {
+      AppendCoverageV2(writer, entry->coverage);
     }
   }
 
-  send(sock, "N", 1, 0);
+  writer.AppendByte('N');
 
-  mutex.UnlockRead();
-
-  return 1;
+#ifdef linux
+  return SendReply(sock, writer);
+#else
+  return writer.Flush(sock);
+#endif
 }
 
-bool CoverageServer::HasNewCoverage(Coverage *client_coverage, Coverage *new_coverage) {
-  CoverageDifference(total_coverage, *client_coverage, *new_coverage);
-  return (!new_coverage->empty());
-}
+void CoverageServer::StoreSamples(std::list<Sample> &new_samples, std::list<Coverage> &sample_coverage, uint64_t client_id) {
+  // don't store the same sample twice,
+  // e.g. if several clients share input samples
+  std::list<SampleInfo> new_sample_info;
+  auto coverage_iter = sample_coverage.begin();
+  for (auto iter = new_samples.begin(); iter != new_samples.end();) {
+    uint64_t hash = iter->GetHash();
+    if (!corpus.hashes.insert(hash).second) {
+      iter = new_samples.erase(iter);
+      coverage_iter = sample_coverage.erase(coverage_iter);
+      continue;
+    }
+    new_sample_info.push_back({ client_id, hash });
+    iter++;
+    coverage_iter++;
+  }
 
-bool CoverageServer::OnNewCoverage(Coverage *client_coverage) {
-  Coverage new_client_coverage;
-  CoverageDifference(total_coverage, *client_coverage, new_client_coverage);
-  if (new_client_coverage.empty()) {
-    return false;
+  if (new_samples.empty()) return;
+
+  size_t first_index = corpus.GetSize();
+  corpus.timestamps.push_back({ server_timestamp, first_index });
+
+  auto info_iter = new_sample_info.begin();
+  coverage_iter = sample_coverage.begin();
+  for(auto iter = new_samples.begin(); iter != new_samples.end(); iter++, info_iter++, coverage_iter++) {
+    size_t index = corpus.GetSize();
+    Coverage *coverage = coverage_iter->empty() ? NULL : &(*coverage_iter);
+    corpus.Append(*iter, *info_iter, coverage);
+    PersistSample(corpus.Get(index));
+    if (coverage) JournalSampleCoverage(journal_fp, index, *coverage);
   }
-  server_timestamp++;
-  MergeCoverage(total_coverage, new_client_coverage);
-  return true;
+
+  JournalSamples(journal_fp, server_timestamp, first_index, new_samples.size());
+  fflush(journal_fp);
+
+  num_samples = corpus.GetSize();
 }
 
-int CoverageServer::ReportNewCoverage(socket_type sock) {
+int CoverageServer::ReportNewCoverage(socket_type sock, int wire_version) {
   char command;
   
   Coverage client_coverage;
-  Coverage new_client_coverage;
 
-  if(!RecvCoverage(sock, client_coverage)) {
-    return 0;
+  uint64_t client_id = 0;
+
+  if (wire_version >= 3) {
+    if (!Read(sock, &client_id, sizeof(client_id))) {
+      return 0;
+    }
+  }
+
+  if (wire_version >= 2) {
+    if (!RecvCoverageV2(sock, client_coverage)) {
+      return 0;
+    }
+  } else {
+    if (!RecvCoverage(sock, client_coverage)) {
+      return 0;
+    }
   }
   
-  mutex.LockRead();
-  if (!HasNewCoverage(&client_coverage, &new_client_coverage)) {
-    mutex.UnlockRead();
-    send(sock, "N", 1, 0);
+  // coverage the server can't store would be reported as new
+  // over and over, so the request fails instead
+  if (!total_coverage.HasRoomFor(client_coverage)) {
+    WARN("Coverage report with too many modules, rejecting it");
+    return 0;
+  }
+
+  // doesn't need any lock
+  if (!total_coverage.HasNewCoverage(client_coverage)) {
+    send(sock, "N", 1, SEND_FLAGS);
     return 1;
   }
-  mutex.UnlockRead();
 
-  send(sock, "Y", 1, 0);
+  send(sock, "Y", 1, SEND_FLAGS);
 
   std::list<Sample> new_samples;
 
@@ -321,40 +577,48 @@ int CoverageServer::ReportNewCoverage(socket_type sock) {
 
     if (command != 'S') return 0;
 
-    Sample sample;
-    if (!RecvSample(sock, sample)) {
-      return 0;
+    new_samples.push_back(Sample());
+    Sample &sample = new_samples.back();
+    if (wire_version >= 2) {
+      if (!RecvSampleV2(sock, sample)) return 0;
+    } else {
+      if (!RecvSample(sock, sample)) return 0;
     }
-
-    new_samples.push_back(sample);
   }
 
-  mutex.LockWrite();
-
-  // we need to check coverage twice as another thread could have
-  // updated it just before lock
-  if (!OnNewCoverage(&new_client_coverage)) {
-    mutex.UnlockWrite();
+  // another client could have reported the same coverage in the
+  // meantime. Merging determines which offsets are really new,
+  // and only those reports need the lock to update the corpus
+  Coverage novel_coverage;
+  if (!total_coverage.Merge(client_coverage, &novel_coverage)) {
     return 1;
   }
 
-  if (!new_samples.empty()) {
-    corpus.timestamps.push_back({ server_timestamp, corpus.samples.size() });
-  }
+  mutex.LockWrite();
 
-  for(auto iter = new_samples.begin(); iter != new_samples.end(); iter++) {
-    char fileindex[20];
-    sprintf(fileindex, "%05zu", corpus.samples.size());
-    std::string sample_file = DirJoin(sample_dir, std::string("sample_") + fileindex);
-    iter->Save(sample_file.c_str());
+  server_timestamp++;
 
-    corpus.samples.push_back(*iter);
-  }
+  JournalCoverage(journal_fp, server_timestamp, novel_coverage);
+  fflush(journal_fp);
 
-  num_samples = corpus.samples.size();
+  // the coverage can only be attributed to the sample if there is
+  // just one (fuzzers report samples one by one, relays in batches)
+  std::list<Coverage> sample_coverage(new_samples.size());
+  if (new_samples.size() == 1) sample_coverage.front() = client_coverage;
+  StoreSamples(new_samples, sample_coverage, client_id);
 
   mutex.UnlockWrite();
 
+  // only what is new to this server gets forwarded upstream
+  if (upstream) {
+    relay_mutex.Lock();
+    MergeCoverage(relay_coverage, novel_coverage);
+    for (auto iter = new_samples.begin(); iter != new_samples.end(); iter++) {
+      relay_samples.push_back(new Sample(*iter));
+    }
+    relay_mutex.Unlock();
+  }
+
   return 1;
 }
 
@@ -377,7 +641,7 @@ bool CoverageServer::CheckFilename(std::string& filename) {
 }
 
 
-int CoverageServer::ReportCrash(socket_type sock) {
+int CoverageServer::ReportCrash(socket_type sock, int wire_version) {
   char command;
 
   while (1) {
@@ -390,8 +654,10 @@ int CoverageServer::ReportCrash(socket_type sock) {
     if (command != 'S') return 0;
 
     Sample sample;
-    if (!RecvSample(sock, sample)) {
-      return 0;
+    if (wire_version >= 2) {
+      if (!RecvSampleV2(sock, sample)) return 0;
+    } else {
+      if (!RecvSample(sock, sample)) return 0;
     }
 
     std::string crash_desc;
@@ -404,72 +670,386 @@ int CoverageServer::ReportCrash(socket_type sock) {
       continue;
     }
     
+    uint64_t hash = sample.GetHash();
+    uint64_t cur_time = (uint64_t)time(NULL);
     bool should_save_crash = false;
-    int duplicates = 0;
-    
+
     crash_mutex.Lock();
     num_crashes++;
 
-    auto crash_it = unique_crashes.find(crash_desc);
-    if(crash_it == unique_crashes.end()) {
-      should_save_crash = true;
-      duplicates = 1;
-      unique_crashes[crash_desc] = 1;
+    auto crash_it = crash_buckets.find(crash_desc);
+    if (crash_it == crash_buckets.end()) {
+      crash_it = crash_buckets.insert({ crash_desc, CrashBucket(cur_time) }).first;
       num_unique_crashes++;
-    } else {
-      if(crash_it->second < MAX_SERVER_IDENTICAL_CRASHES) {
+    }
+    CrashBucket &bucket = crash_it->second;
+    bucket.hits++;
+    bucket.last_seen = cur_time;
+
+    // the same crashing input is often reported by several
+    // clients, only distinct inputs count towards the limit
+    if ((bucket.stored < MAX_SERVER_IDENTICAL_CRASHES) &&
+        (std::find(bucket.hashes.begin(), bucket.hashes.end(), hash) == bucket.hashes.end()))
+    {
+      if (crash_queue.size() < MAX_CRASH_QUEUE_SIZE) {
         should_save_crash = true;
-        crash_it->second++;
-        duplicates = crash_it->second;
+        bucket.stored++;
+        bucket.hashes.push_back(hash);
+        std::string crash_filename = crash_desc + "_" + std::to_string(bucket.stored);
+        crash_queue.push_back({ new Sample(sample), DirJoin(crash_dir, crash_filename) });
+      } else {
+        num_crashes_dropped++;
       }
     }
 
-    if(should_save_crash) {
-      std::string crash_filename = crash_desc + "_" + std::to_string(duplicates);
-      std::string outfile = DirJoin(crash_dir, crash_filename);
-      sample.Save(outfile.c_str());
-    }
-
     crash_mutex.Unlock();
+
+    // the upstream server applies the same limit, no need
+    // to forward the crashes that were dropped here
+    if (should_save_crash && upstream) {
+      relay_mutex.Lock();
+      relay_crashes.push_back({ new Sample(sample), crash_desc });
+      relay_mutex.Unlock();
+    }
   }
 
   return 1;
 }
 
-void CoverageServer::SaveState() {
-  mutex.LockRead();
+// most frequent first
+static bool CompareCrashBuckets(const std::pair<std::string, CoverageServer::CrashBucket> &a,
+                                const std::pair<std::string, CoverageServer::CrashBucket> &b)
+{
+  return a.second.hits > b.second.hits;
+}
+
+void CoverageServer::WriteCrashSummary() {
+  std::string out_file = DirJoin(out_dir, std::string("crash_summary.txt"));
+  std::string temp_file = out_file + ".tmp";
+
+  // copy the stats so that the file is written without holding
+  // the lock ReportCrash takes. The copies keep the hit counts
+  // as of the last summary, from which the rate is computed
+  crash_mutex.Lock();
+
+  std::vector<std::pair<std::string, CrashBucket>> buckets;
+  for (auto iter = crash_buckets.begin(); iter != crash_buckets.end(); iter++) {
+    buckets.push_back({ iter->first, iter->second });
+    iter->second.hits_at_last_summary = iter->second.hits;
+  }
+  size_t crashes = num_crashes;
+  size_t unique_crashes = num_unique_crashes;
+  size_t crashes_dropped = num_crashes_dropped;
+
+  crash_mutex.Unlock();
+
+  std::sort(buckets.begin(), buckets.end(), CompareCrashBuckets);
+
+  FILE *fp = fopen(temp_file.c_str(), "w");
+  if (!fp) {
+    WARN("Error writing crash summary");
+    return;
+  }
+
+  fprintf(fp, "Crashes: %zu (%zu unique, %zu not saved because the queue was full)\n\n",
+          crashes, unique_crashes, crashes_dropped);
+  fprintf(fp, "crash hits hits_per_minute saved first_seen last_seen\n");
+
+  for (auto iter = buckets.begin(); iter != buckets.end(); iter++) {
+    CrashBucket &bucket = iter->second;
+    uint64_t recent_hits = bucket.hits - bucket.hits_at_last_summary;
+    fprintf(fp, "%s %llu %llu %llu %llu %llu\n", iter->first.c_str(),
+            (unsigned long long)bucket.hits,
+            (unsigned long long)(recent_hits * 60 / CRASH_SUMMARY_INTERVAL),
+            (unsigned long long)bucket.stored,
+            (unsigned long long)bucket.first_seen,
+            (unsigned long long)bucket.last_seen);
+  }
+
+  fclose(fp);
+  remove(out_file.c_str());
+  rename(temp_file.c_str(), out_file.c_str());
+}
+
+void CoverageServer::CrashWriterThread() {
+  uint64_t last_summary_time = GetCurTime();
+
+  while (1) {
+    if ((GetCurTime() - last_summary_time) >= CRASH_SUMMARY_INTERVAL * 1000) {
+      WriteCrashSummary();
+      last_summary_time = GetCurTime();
+    }
+
+    crash_mutex.Lock();
+    if (crash_queue.empty()) {
+      crash_mutex.Unlock();
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+      Sleep(CRASH_WRITER_POLL_INTERVAL);
+#else
+      usleep(CRASH_WRITER_POLL_INTERVAL * 1000);
+#endif
+      continue;
+    }
+    PendingCrash crash = crash_queue.front();
+    crash_queue.pop_front();
+    crash_mutex.Unlock();
+
+    crash.sample->Save(crash.filename.c_str());
+    delete crash.sample;
+  }
+}
 
+void CoverageServer::SaveState() {
+  // the corpus and the coverage are written as they change,
+  // only the upstream client state of a relay is left
   std::string out_file = DirJoin(out_dir, std::string("server_state.dat"));
   FILE *fp = fopen(out_file.c_str(), "wb");
   if (!fp) {
     FATAL("Error saving server state");
   }
 
-  fwrite(&num_samples, sizeof(num_samples), 1, fp);
+  uint64_t magic = SERVER_STATE_MAGIC;
+  fwrite(&magic, sizeof(magic), 1, fp);
 
-  fwrite(&server_timestamp, sizeof(server_timestamp), 1, fp);
+  if (upstream) upstream->SaveState(fp);
 
-  WriteCoverageBinary(total_coverage, fp);
+  fclose(fp);
+}
 
-  uint64_t size;
+void CoverageServer::CreateStorage() {
+  std::string data_file = DirJoin(out_dir, std::string("server_corpus.dat"));
+  std::string index_file = DirJoin(out_dir, std::string("server_corpus.idx"));
+  std::string journal_file = DirJoin(out_dir, std::string("server_coverage.journal"));
 
-  // write corpus
-  size = corpus.samples.size();
-  fwrite(&size, sizeof(size), 1, fp);
-  //corpus timestamps
-  size = corpus.timestamps.size();
+  corpus_data_fp = fopen(data_file.c_str(), "wb");
+  corpus_index_fp = fopen(index_file.c_str(), "wb");
+  journal_fp = fopen(journal_file.c_str(), "wb");
+  if (!corpus_data_fp || !corpus_index_fp || !journal_fp) {
+    FATAL("Error creating server corpus files");
+  }
+
+  corpus_data_size = 0;
+}
+
+void CoverageServer::PersistSample(ServerCorpus::Entry *entry) {
+  CorpusIndexEntry index_entry;
+  index_entry.offset = corpus_data_size;
+  index_entry.size = entry->size;
+  index_entry.info = entry->info;
+
+  // data goes first so that the index never
+  // points to data that wasn't written
+  if (entry->size) fwrite(entry->bytes, 1, entry->size, corpus_data_fp);
+  fflush(corpus_data_fp);
+  fwrite(&index_entry, sizeof(index_entry), 1, corpus_index_fp);
+  fflush(corpus_index_fp);
+
+  corpus_data_size += entry->size;
+}
+
+void CoverageServer::WriteJournalCoverage(FILE *fp, Coverage &coverage) {
+  std::string encoded;
+  EncodeCoverage(coverage, encoded);
+  uint64_t size = encoded.size();
   fwrite(&size, sizeof(size), 1, fp);
-  if(size) fwrite(&corpus.timestamps[0], sizeof(corpus.timestamps[0]), size, fp);
+  fwrite(encoded.data(), 1, encoded.size(), fp);
+}
 
-  fclose(fp);
+bool CoverageServer::ReadJournalCoverage(FILE *fp, Coverage &coverage) {
+  uint64_t size;
+  if (fread(&size, sizeof(size), 1, fp) != 1) return false;
+  // sanity check, the journal could be truncated
+  if (size > 0x80000000ULL) return false;
 
-  mutex.UnlockRead();
+  std::string encoded;
+  encoded.resize((size_t)size);
+  if (size && (fread(&encoded[0], 1, (size_t)size, fp) != size)) return false;
+
+  return DecodeCoverage(encoded.data(), encoded.size(), coverage);
+}
+
+// journal records:
+// 'C' timestamp coverage - coverage added at the given timestamp
+// 'S' timestamp first_index count - samples added at the given timestamp
+// 'P' index coverage - coverage reported with a sample
+
+void CoverageServer::JournalCoverage(FILE *fp, uint64_t timestamp, Coverage &coverage) {
+  fputc('C', fp);
+  fwrite(&timestamp, sizeof(timestamp), 1, fp);
+  WriteJournalCoverage(fp, coverage);
+}
+
+void CoverageServer::JournalSamples(FILE *fp, uint64_t timestamp, uint64_t first_index, uint64_t count) {
+  fputc('S', fp);
+  fwrite(&timestamp, sizeof(timestamp), 1, fp);
+  fwrite(&first_index, sizeof(first_index), 1, fp);
+  fwrite(&count, sizeof(count), 1, fp);
+}
+
+void CoverageServer::JournalSampleCoverage(FILE *fp, uint64_t index, Coverage &coverage) {
+  fputc('P', fp);
+  fwrite(&index, sizeof(index), 1, fp);
+  WriteJournalCoverage(fp, coverage);
 }
 
+void CoverageServer::WriteJournal(FILE *fp) {
+  // a compacted journal with the same state as the current one
+  Coverage coverage;
+  total_coverage.GetCoverage(coverage);
+  JournalCoverage(fp, server_timestamp, coverage);
+
+  size_t corpus_size = corpus.GetSize();
+  for (size_t i = 0; i < corpus.timestamps.size(); i++) {
+    uint64_t first_index = corpus.timestamps[i].index;
+    uint64_t last_index = corpus_size;
+    if (i + 1 < corpus.timestamps.size()) last_index = corpus.timestamps[i + 1].index;
+    if (last_index <= first_index) continue;
+    JournalSamples(fp, corpus.timestamps[i].timestamp, first_index, last_index - first_index);
+  }
+
+  for (size_t i = 0; i < corpus_size; i++) {
+    ServerCorpus::Entry *entry = corpus.Get(i);
+    if (entry->coverage.empty()) continue;
+    JournalSampleCoverage(fp, i, entry->coverage);
+  }
+}
+
+void CoverageServer::ReplayJournal(FILE *fp) {
+  size_t corpus_size = corpus.GetSize();
+
+  // stops at the first incomplete record
+  while (1) {
+    int type = fgetc(fp);
+
+    if (type == 'C') {
+      uint64_t timestamp;
+      Coverage coverage;
+      if (fread(&timestamp, sizeof(timestamp), 1, fp) != 1) break;
+      if (!ReadJournalCoverage(fp, coverage)) break;
+      total_coverage.Merge(coverage, NULL);
+      if (timestamp > server_timestamp) server_timestamp = timestamp;
+    } else if (type == 'S') {
+      uint64_t values[3];
+      if (fread(values, sizeof(values[0]), 3, fp) != 3) break;
+      // the samples could be missing if the server was killed
+      if ((values[1] + values[2]) > corpus_size) break;
+      corpus.timestamps.push_back({ values[0], values[1] });
+      if (values[0] > server_timestamp) server_timestamp = values[0];
+    } else if (type == 'P') {
+      uint64_t index;
+      Coverage coverage;
+      if (fread(&index, sizeof(index), 1, fp) != 1) break;
+      if (!ReadJournalCoverage(fp, coverage)) break;
+      // nobody else accesses the corpus while restoring
+      if (index < corpus_size) corpus.Get((size_t)index)->coverage = coverage;
+    } else {
+      break;
+    }
+  }
+}
+
+void CoverageServer::LoadStorage() {
+  std::string data_file = DirJoin(out_dir, std::string("server_corpus.dat"));
+  std::string index_file = DirJoin(out_dir, std::string("server_corpus.idx"));
+  std::string journal_file = DirJoin(out_dir, std::string("server_coverage.journal"));
+
+  if (!corpus_map.Open(data_file.c_str())) {
+    FATAL("Error mapping server corpus");
+  }
+  corpus_data_size = corpus_map.GetSize();
+
+  FILE *fp = fopen(index_file.c_str(), "rb");
+  if (!fp) {
+    FATAL("Error reading server corpus index");
+  }
+  std::vector<CorpusIndexEntry> index;
+  CorpusIndexEntry index_entry;
+  while (fread(&index_entry, sizeof(index_entry), 1, fp) == 1) {
+    if ((index_entry.offset > corpus_data_size) ||
+        (index_entry.size > corpus_data_size - index_entry.offset))
+    {
+      break;
+    }
+    index.push_back(index_entry);
+  }
+  fclose(fp);
+
+  for (size_t i = 0; i < index.size(); i++) {
+    const char *bytes = corpus_map.GetData() + index[i].offset;
+    corpus.AppendMapped(bytes, (size_t)index[i].size, index[i].info);
+    corpus.hashes.insert(index[i].info.hash);
+    if (upstream) upstream->AddKnownSample(index[i].info.hash);
+  }
+
+  fp = fopen(journal_file.c_str(), "rb");
+  if (fp) {
+    ReplayJournal(fp);
+    fclose(fp);
+  }
+
+  // the index is rewritten without any incomplete entries at
+  // the end and the journal is compacted. New samples are appended
+  // to the data file, which doesn't affect the existing mapping
+  corpus_data_fp = fopen(data_file.c_str(), "ab");
+  corpus_index_fp = fopen(index_file.c_str(), "wb");
+  if (!corpus_data_fp || !corpus_index_fp) {
+    FATAL("Error opening server corpus files");
+  }
+  if (!index.empty()) {
+    fwrite(&index[0], sizeof(index[0]), index.size(), corpus_index_fp);
+  }
+  fflush(corpus_index_fp);
+
+  std::string temp_file = journal_file + ".tmp";
+  fp = fopen(temp_file.c_str(), "wb");
+  if (!fp) {
+    FATAL("Error writing server coverage journal");
+  }
+  WriteJournal(fp);
+  fclose(fp);
+  remove(journal_file.c_str());
+  if (rename(temp_file.c_str(), journal_file.c_str())) {
+    FATAL("Error writing server coverage journal");
+  }
+
+  journal_fp = fopen(journal_file.c_str(), "ab");
+  if (!journal_fp) {
+    FATAL("Error opening server coverage journal");
+  }
+}
 
 void CoverageServer::RestoreState() {
   mutex.LockWrite();
 
+  std::string index_file = DirJoin(out_dir, std::string("server_corpus.idx"));
+  FILE *fp = fopen(index_file.c_str(), "rb");
+  if (!fp) {
+    RestoreLegacyState();
+    num_samples = corpus.GetSize();
+    mutex.UnlockWrite();
+    return;
+  }
+  fclose(fp);
+
+  LoadStorage();
+  num_samples = corpus.GetSize();
+
+  std::string out_file = DirJoin(out_dir, std::string("server_state.dat"));
+  fp = fopen(out_file.c_str(), "rb");
+  if (fp) {
+    uint64_t magic;
+    if ((fread(&magic, sizeof(magic), 1, fp) == 1) && (magic == SERVER_STATE_MAGIC)) {
+      if (upstream) upstream->LoadState(fp);
+    }
+    fclose(fp);
+  }
+
+  mutex.UnlockWrite();
+}
+
+void CoverageServer::RestoreLegacyState() {
+  // the original format kept each sample in a separate file
+  // and the complete coverage in the state file
   std::string out_file = DirJoin(out_dir, std::string("server_state.dat"));
   FILE *fp = fopen(out_file.c_str(), "rb");
   if (!fp) {
@@ -480,28 +1060,90 @@ void CoverageServer::RestoreState() {
 
   fread(&server_timestamp, sizeof(server_timestamp), 1, fp);
 
-  ReadCoverageBinary(total_coverage, fp);
+  Coverage coverage;
+  ReadCoverageBinary(coverage, fp);
+  total_coverage.Merge(coverage, NULL);
 
   uint64_t size;
 
   // read corpus
-  fread(&size, sizeof(size), 1, fp);
-  for (size_t i = 0; i < size; i++) {
-    Sample sample;
+  uint64_t corpus_size;
+  fread(&corpus_size, sizeof(corpus_size), 1, fp);
+  std::vector<Sample> samples((size_t)corpus_size);
+  for (size_t i = 0; i < corpus_size; i++) {
     char fileindex[20];
     sprintf(fileindex, "%05zu", i);
     std::string sample_file = DirJoin(sample_dir, std::string("sample_") + fileindex);
-    sample.Load(sample_file.c_str());
-    corpus.samples.push_back(sample);
+    samples[i].Load(sample_file.c_str());
   }
   //corpus timestamps
   fread(&size, sizeof(size), 1, fp);
   corpus.timestamps.resize(size);
-  fread(&corpus.timestamps[0], sizeof(corpus.timestamps[0]), size, fp);
+  if(size) fread(&corpus.timestamps[0], sizeof(corpus.timestamps[0]), size, fp);
 
   fclose(fp);
 
-  mutex.UnlockWrite();
+  // the origin and the coverage of each sample weren't recorded
+  for (size_t i = 0; i < corpus_size; i++) {
+    SampleInfo info = { 0, samples[i].GetHash() };
+    Coverage sample_coverage;
+    corpus.hashes.insert(info.hash);
+    corpus.Append(samples[i], info, &sample_coverage);
+    if (upstream) upstream->AddKnownSample(&samples[i]);
+  }
+
+  // convert to the packed format
+  CreateStorage();
+  for (size_t i = 0; i < corpus_size; i++) {
+    PersistSample(corpus.Get(i));
+  }
+  WriteJournal(journal_fp);
+  fflush(journal_fp);
+}
+
+int CoverageServer::NegotiateWireVersion(socket_type sock) {
+  char client_version;
+  if (!Read(sock, &client_version, 1)) return 0;
+
+  char version = (client_version < WIRE_VERSION) ? client_version : WIRE_VERSION;
+  if (send(sock, &version, 1, SEND_FLAGS) != 1) return 0;
+
+  return 1;
+}
+
+int CoverageServer::HandleCommand(socket_type sock, char command) {
+  send(sock, "K", 1, SEND_FLAGS);
+
+  // lowercase commands use wire version 2 and later,
+  // new letters are used whenever the message layout changes
+  switch (command) {
+  case 'X':
+    return ReportCrash(sock, 1);
+  case 'x':
+    return ReportCrash(sock, 2);
+  case 'S':
+    return ReportNewCoverage(sock, 1);
+  case 'c':
+    return ReportNewCoverage(sock, 2);
+  case 'r':
+    return ReportNewCoverage(sock, 3);
+  case 'U':
+    return ServeUpdates(sock, 1);
+  case 'u':
+    return ServeUpdates(sock, 2);
+  case 'k':
+    return ServeUpdates(sock, 3);
+  case 'q':
+    return ServeUpdates(sock, 4);
+  case 'g':
+    return ServeUpdates(sock, 5);
+  case 'V':
+    return NegotiateWireVersion(sock);
+  default:
+    break;
+  }
+
+  return 0;
 }
 
 int CoverageServer::HandleConnection(socket_type sock) {
@@ -522,19 +1164,9 @@ int CoverageServer::HandleConnection(socket_type sock) {
 
   if (cur_n_connections > MAX_CONNECTIONS) {
     // tell the client to wait and retry
-    send(sock, "W", 1, 0);
+    send(sock, "W", 1, SEND_FLAGS);
   } else {
-    send(sock, "K", 1, 0);
-
-    if (command == 'X') {
-      ret = ReportCrash(sock);
-    } else if (command == 'S') {
-      ret = ReportNewCoverage(sock);
-    } else if (command == 'U') {
-      ret = ServeUpdates(sock);
-    } else {
-      ret = 0;
-    }
+    ret = HandleCommand(sock, command);
   }
 
   connection_mutex.Lock();
@@ -544,6 +1176,269 @@ int CoverageServer::HandleConnection(socket_type sock) {
   return ret;
 }
 
+CoverageServer::~CoverageServer() {
+  if (upstream) delete upstream;
+  if (corpus_data_fp) fclose(corpus_data_fp);
+  if (corpus_index_fp) fclose(corpus_index_fp);
+  if (journal_fp) fclose(journal_fp);
+}
+
+void CoverageServer::SyncWithUpstream() {
+  Coverage coverage;
+  std::list<Sample *> samples;
+  std::list<std::pair<Sample *, std::string>> crashes;
+
+  relay_mutex.Lock();
+  coverage.swap(relay_coverage);
+  samples.swap(relay_samples);
+  crashes.swap(relay_crashes);
+  relay_mutex.Unlock();
+
+  // everything that's new since the last sync is sent as a single
+  // batch. If sending fails, the data is queued again for next time
+  if (!crashes.empty()) {
+    if (upstream->ReportCrashes(crashes)) {
+      for (auto iter = crashes.begin(); iter != crashes.end(); iter++) {
+        delete iter->first;
+      }
+    } else {
+      relay_mutex.Lock();
+      relay_crashes.splice(relay_crashes.begin(), crashes);
+      relay_mutex.Unlock();
+    }
+  }
+
+  if (!coverage.empty()) {
+    if (upstream->ReportNewCoverage(&coverage, samples)) {
+      for (auto iter = samples.begin(); iter != samples.end(); iter++) {
+        upstream->AddKnownSample(*iter);
+        delete *iter;
+      }
+    } else {
+      relay_mutex.Lock();
+      MergeCoverage(relay_coverage, coverage);
+      relay_samples.splice(relay_samples.begin(), samples);
+      relay_mutex.Unlock();
+    }
+  }
+
+  // upstream sees the relay as a single client
+  // with the combined stats of our clients
+  ClientStats stats;
+  size_t num_active, num_stale;
+  fleet_stats.GetFleetTotals(stats, &num_active, &num_stale);
+
+  std::list<Sample *> new_samples;
+  std::list<Coverage> sample_coverage;
+  upstream->GetUpdates(new_samples, stats, &sample_coverage);
+
+  std::list<Sample> upstream_samples;
+  for (auto iter = new_samples.begin(); iter != new_samples.end(); iter++) {
+    (*iter)->EnsureLoaded();
+    upstream_samples.push_back(**iter);
+    delete *iter;
+  }
+
+  if (upstream_samples.empty()) return;
+
+  // the coverage of upstream samples is merged, so that our clients
+  // reporting the same coverage don't get it forwarded upstream again
+  Coverage upstream_coverage;
+  for (auto iter = sample_coverage.begin(); iter != sample_coverage.end(); iter++) {
+    MergeCoverage(upstream_coverage, *iter);
+  }
+  Coverage novel_coverage;
+  bool has_novel_coverage = total_coverage.Merge(upstream_coverage, &novel_coverage);
+
+  mutex.LockWrite();
+  // the clients need a new timestamp in order to get the samples
+  server_timestamp++;
+  if (has_novel_coverage) {
+    JournalCoverage(journal_fp, server_timestamp, novel_coverage);
+  }
+  StoreSamples(upstream_samples, sample_coverage, 0);
+  mutex.UnlockWrite();
+
+  printf("Got %zu new samples from upstream\n", upstream_samples.size());
+}
+
+static size_t GetNumOffsets(Coverage &coverage) {
+  size_t ret = 0;
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    ret += iter->offsets.size();
+  }
+  return ret;
+}
+
+// The coverage recorded with a sample is only what was new to the fuzzer
+// that found it, not everything the sample reaches. The rest was already
+// known to that fuzzer, from samples it reported before (its input samples
+// included) or got from the server, all of which are recorded here too. So
+// covering the recorded coverage of every sample also covers what dropped
+// samples reach, except for coverage only ever reported without a sample:
+// flaky coverage, and that of input samples a fuzzer couldn't report (e.g.
+// when too many reports were pending). Samples that have no recorded
+// coverage can't be shown to be redundant and are always kept
+void CoverageServer::DistillCorpus() {
+  // published corpus entries never change, so no lock is needed
+  size_t size = corpus.GetSize();
+
+  distill_mutex.Lock();
+  bool up_to_date = (size == distilled_size);
+  distill_mutex.Unlock();
+  if (up_to_date) return;
+
+  std::vector<size_t> selected;
+
+  // candidates ordered by the number of offsets they'd add.
+  // The counts can only decrease as more samples are selected,
+  // so they are recomputed lazily when a candidate comes on top
+  std::priority_queue<std::pair<size_t, size_t>> candidates;
+  for (size_t i = 0; i < size; i++) {
+    Coverage &coverage = corpus.Get(i)->coverage;
+    if (coverage.empty()) {
+      // can't tell what the sample covers, keep it
+      selected.push_back(i);
+      continue;
+    }
+    candidates.push({ GetNumOffsets(coverage), i });
+  }
+
+  Coverage covered;
+  while (!candidates.empty()) {
+    std::pair<size_t, size_t> candidate = candidates.top();
+    candidates.pop();
+
+    Coverage new_coverage;
+    CoverageDifference(covered, corpus.Get(candidate.second)->coverage, new_coverage);
+    size_t num_new_offsets = GetNumOffsets(new_coverage);
+    if (!num_new_offsets) continue;
+
+    if (!candidates.empty() && (num_new_offsets < candidates.top().first)) {
+      candidates.push({ num_new_offsets, candidate.second });
+      continue;
+    }
+
+    selected.push_back(candidate.second);
+    MergeCoverage(covered, new_coverage);
+  }
+
+  // keep the original order of samples
+  std::sort(selected.begin(), selected.end());
+
+  printf("Distilled corpus: %zu of %zu samples\n", selected.size(), size);
+
+  distill_mutex.Lock();
+  distilled_samples.swap(selected);
+  distilled_size = size;
+  distill_mutex.Unlock();
+}
+
+void CoverageServer::DistillThread() {
+  while (1) {
+    DistillCorpus();
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(distill_interval * 1000);
+#else
+    usleep(distill_interval * 1000000);
+#endif
+  }
+}
+
+void CoverageServer::RelayThread() {
+  while (1) {
+    SyncWithUpstream();
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+    Sleep(relay_interval * 1000);
+#else
+    usleep(relay_interval * 1000000);
+#endif
+  }
+}
+
+int CoverageServer::ServeAdminRequest(socket_type sock) {
+  // read the whole request, even though only the first
+  // line matters, so that the connection closes cleanly
+  std::string request;
+  char buf[1024];
+  while ((request.find("\r\n\r\n") == std::string::npos) &&
+         (request.find("\n\n") == std::string::npos) &&
+         (request.size() < MAX_ADMIN_REQUEST_SIZE))
+  {
+    int received = recv(sock, buf, sizeof(buf), 0);
+    if (received <= 0) return 0;
+    request.append(buf, received);
+  }
+
+  // e.g. "GET /metrics HTTP/1.1"
+  std::string path;
+  if (request.compare(0, 4, "GET ") == 0) {
+    size_t path_end = request.find_first_of(" ?\r\n", 4);
+    if (path_end != std::string::npos) path = request.substr(4, path_end - 4);
+  }
+
+  std::string body;
+  std::string status = "200 OK";
+  std::string content_type;
+  if (path == "/metrics") {
+    fleet_stats.GetPrometheus(body);
+    content_type = "text/plain; version=0.0.4";
+  } else if ((path == "/") || (path == "/stats")) {
+    fleet_stats.GetJSON(body);
+    content_type = "application/json";
+  } else {
+    status = "404 Not Found";
+    content_type = "text/plain";
+    body = "Not found\n";
+  }
+
+  std::string response = "HTTP/1.0 " + status + "\r\n";
+  response += "Content-Type: " + content_type + "\r\n";
+  response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  response += "Connection: close\r\n\r\n";
+  response += body;
+
+  return Write(sock, response.data(), response.size());
+}
+
+void CoverageServer::AdminThread() {
+  socket_type admin_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (admin_socket == INVALID_SOCKET) {
+    FATAL("socket failed");
+  }
+
+  // the stats are only served to the local machine
+  struct sockaddr_in admin_addr;
+  memset(&admin_addr, 0, sizeof(admin_addr));
+  admin_addr.sin_family = AF_INET;
+  admin_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  admin_addr.sin_port = htons(admin_port);
+
+  if (bind(admin_socket, (struct sockaddr*)&admin_addr, sizeof(admin_addr))) {
+    FATAL("bind failed on admin port %d", admin_port);
+  }
+
+  if (listen(admin_socket, SOMAXCONN)) {
+    FATAL("listen failed on admin port %d", admin_port);
+  }
+
+  printf("Serving stats on 127.0.0.1:%d\n", admin_port);
+
+  // requests are rare, so they are handled one at a time
+  while (1) {
+    socket_type sock = accept(admin_socket, NULL, NULL);
+    if (sock == INVALID_SOCKET) continue;
+
+    if (SetSocketOptions(sock)) {
+      ServeAdminRequest(sock);
+    }
+
+    closesocket(sock);
+  }
+}
+
 void CoverageServer::StatusThread() {
   int seconds_since_last_save = 0;
 
@@ -560,6 +1455,14 @@ void CoverageServer::StatusThread() {
     printf("Num connections: %zu\n", num_connections);
     printf("Num samples: %zu\n", num_samples);
     printf("Num crashes: %zu (%zu unique)\n", num_crashes, num_unique_crashes);
+
+    fleet_stats.AddServerStats(total_coverage.GetNumOffsets(), num_samples, num_crashes);
+
+    ClientStats totals;
+    size_t num_active, num_stale;
+    fleet_stats.GetFleetTotals(totals, &num_active, &num_stale);
+    printf("Num clients: %zu active, %zu stale\n", num_active, num_stale);
+    printf("Fleet execs: %llu (%llu/s)\n", totals.total_execs, totals.execs_per_sec);
     printf("\n");
 
     if (seconds_since_last_save > SERVER_SAVE_INERVAL) {
@@ -583,6 +1486,44 @@ void *StartStatusThread(void *arg) {
   return NULL;
 }
 
+void *StartAdminThread(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->AdminThread();
+  return NULL;
+}
+
+void *StartDistillThread(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->DistillThread();
+  return NULL;
+}
+
+void *StartCrashWriterThread(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->CrashWriterThread();
+  return NULL;
+}
+
+void *StartRelayThread(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->RelayThread();
+  return NULL;
+}
+
+#ifdef linux
+void *StartEpollWorker(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->EpollWorker();
+  return NULL;
+}
+
+void *StartCommandWatchdog(void *arg) {
+  CoverageServer *server = (CoverageServer *)arg;
+  server->CommandWatchdog();
+  return NULL;
+}
+#endif
+
 void CoverageServer::Init(int argc, char **argv) {
   char *option;
 
@@ -604,12 +1545,29 @@ void CoverageServer::Init(int argc, char **argv) {
     server_port = atoi(host_port.c_str() + delimiter + 1);
   }
 
+  num_server_threads = GetIntOption("-server_threads", argc, argv, DEFAULT_SERVER_THREADS);
+  compress_samples = GetBinaryOption("-compress_samples", argc, argv, false);
+  if (num_server_threads < 1) num_server_threads = 1;
+
+  distill_interval = GetIntOption("-distill_interval", argc, argv, DEFAULT_DISTILL_INTERVAL);
+  admin_port = GetIntOption("-admin_port", argc, argv, 0);
+
+  if (GetOption("-server", argc, argv)) {
+    upstream = new CoverageClient();
+    upstream->Init(argc, argv);
+    relay_interval = GetIntOption("-relay_interval", argc, argv, DEFAULT_RELAY_INTERVAL);
+    if (relay_interval < 1) relay_interval = 1;
+    printf("Relaying to upstream server %s\n", GetOption("-server", argc, argv));
+  }
+
   SetupDirectories();
 
   if (GetBinaryOption("-restore", argc, argv, false) ||
       GetBinaryOption("-resume", argc, argv, false))
   {
     RestoreState();
+  } else {
+    CreateStorage();
   }
 }
 
@@ -618,14 +1576,235 @@ void CoverageServer::SetupDirectories() {
   CreateDirectory(out_dir);
   crash_dir = DirJoin(out_dir, "server_crashes");
   CreateDirectory(crash_dir);
+  // only used to restore states saved by older versions
   sample_dir = DirJoin(out_dir, "server_samples");
-  CreateDirectory(sample_dir);
 }
 
+bool CoverageServer::SetSocketOptions(socket_type sock) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  DWORD timeout = 10000;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
+    return false;
+  }
+  // clients that stop reading don't block a thread for long either
+  if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
+    return false;
+  }
+#else
+  struct timeval tv;
+  tv.tv_sec = 10; // 10 Secs Timeout 
+  tv.tv_usec = 0;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(struct timeval))) {
+    return false;
+  }
+  // clients that stop reading don't block a thread for long either
+  if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&tv, sizeof(struct timeval))) {
+    return false;
+  }
+  // persistent connections can be idle for a long time,
+  // detect clients that went away without closing them
+  int keepalive = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (char*)&keepalive, sizeof(keepalive))) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+#ifdef linux
+
+bool CoverageServer::ArmSocket(socket_type sock, int op) {
+  // EPOLLONESHOT makes sure only one worker handles
+  // a connection at a time. The socket needs to be
+  // re-armed once the command has been handled
+  connection_mutex.Lock();
+  bool reply_pending = (pending_replies.find(sock) != pending_replies.end());
+  connection_mutex.Unlock();
+
+  struct epoll_event event;
+  event.events = (reply_pending ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  event.data.fd = sock;
+  return (epoll_ctl(epoll_fd, op, sock, &event) == 0);
+}
+
+void CoverageServer::CloseConnection(socket_type sock) {
+  // nothing may refer to the socket once it's closed,
+  // as the descriptor can be reused by the next connection
+  connection_mutex.Lock();
+  auto iter = pending_replies.find(sock);
+  if (iter != pending_replies.end()) {
+    delete iter->second;
+    pending_replies.erase(iter);
+  }
+  command_start_times.erase(sock);
+  num_connections--;
+  connection_mutex.Unlock();
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+  closesocket(sock);
+}
+
+int CoverageServer::SendReply(socket_type sock, WireWriter &writer) {
+  int ret = writer.FlushNonBlocking(sock);
+  if (ret >= 0) return ret;
+
+  // the rest is sent by the workers once the socket is writable
+  WireWriter *reply = new WireWriter(std::move(writer));
+  connection_mutex.Lock();
+  pending_replies[sock] = reply;
+  connection_mutex.Unlock();
+
+  return 1;
+}
+
+int CoverageServer::SendPendingReply(socket_type sock) {
+  connection_mutex.Lock();
+  auto iter = pending_replies.find(sock);
+  WireWriter *reply = (iter != pending_replies.end()) ? iter->second : NULL;
+  connection_mutex.Unlock();
+
+  if (!reply) return 1;
+
+  // only one worker handles the connection at a
+  // time, so the reply can be sent without the lock
+  int ret = reply->FlushNonBlocking(sock);
+  if (ret < 0) return 1;
+
+  connection_mutex.Lock();
+  pending_replies.erase(sock);
+  connection_mutex.Unlock();
+  delete reply;
+
+  return ret;
+}
+
+void CoverageServer::AcceptConnections() {
+  while (1) {
+    socket_type client_socket = accept(listen_socket, NULL, NULL);
+    if (client_socket == INVALID_SOCKET) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        WARN("accept failed");
+      }
+      break;
+    }
+
+    // commands are handled with blocking I/O
+    // (with timeouts) once the client sends one
+    if (!SetSocketOptions(client_socket)) {
+      WARN("setsockopt failed");
+      closesocket(client_socket);
+      continue;
+    }
+
+    connection_mutex.Lock();
+    num_connections++;
+    connection_mutex.Unlock();
+
+    if (!ArmSocket(client_socket, EPOLL_CTL_ADD)) {
+      WARN("Error adding client socket to epoll");
+      CloseConnection(client_socket);
+    }
+  }
+
+  if (!ArmSocket(listen_socket, EPOLL_CTL_MOD)) {
+    FATAL("Error re-arming listen socket");
+  }
+}
+
+void CoverageServer::EpollWorker() {
+  struct epoll_event event;
+
+  while (1) {
+    int ret = epoll_wait(epoll_fd, &event, 1, -1);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      FATAL("epoll_wait failed");
+    }
+    if (ret == 0) continue;
+
+    socket_type sock = event.data.fd;
+
+    if (sock == listen_socket) {
+      AcceptConnections();
+      continue;
+    }
+
+    if (event.events & EPOLLERR) {
+      CloseConnection(sock);
+      continue;
+    }
+
+    // the connection is kept open after each command,
+    // clients using the one-shot protocol simply close it
+    int handled;
+    if (event.events & EPOLLOUT) {
+      handled = SendPendingReply(sock);
+    } else {
+      connection_mutex.Lock();
+      command_start_times[sock] = GetCurTime();
+      connection_mutex.Unlock();
+
+      char command;
+      handled = Read(sock, &command, 1) && HandleCommand(sock, command);
+
+      connection_mutex.Lock();
+      command_start_times.erase(sock);
+      connection_mutex.Unlock();
+    }
+    if (!handled || !ArmSocket(sock, EPOLL_CTL_MOD)) {
+      CloseConnection(sock);
+    }
+  }
+}
+
+void CoverageServer::CommandWatchdog() {
+  while (1) {
+    usleep(SERVER_COMMAND_WATCHDOG_INTERVAL * 1000000);
+
+    uint64_t cur_time = GetCurTime();
+
+    // connections are only closed after their entry is removed
+    // (under the lock), so every socket here is still valid.
+    // Shutting it down doesn't release the descriptor, the
+    // worker still closes the connection as usual
+    connection_mutex.Lock();
+    for (auto iter = command_start_times.begin(); iter != command_start_times.end(); iter++) {
+      if ((cur_time - iter->second) > SERVER_COMMAND_TIMEOUT * 1000) {
+        shutdown(iter->first, SHUT_RDWR);
+      }
+    }
+    connection_mutex.Unlock();
+  }
+}
+
+void CoverageServer::RunEpollServer() {
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    FATAL("epoll_create1 failed");
+  }
+
+  int flags = fcntl(listen_socket, F_GETFL, 0);
+  if (flags < 0 || fcntl(listen_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+    FATAL("Error making listen socket non-blocking");
+  }
+
+  if (!ArmSocket(listen_socket, EPOLL_CTL_ADD)) {
+    FATAL("Error adding listen socket to epoll");
+  }
+
+  CreateThread(StartCommandWatchdog, this);
+
+  for (int i = 1; i < num_server_threads; i++) {
+    CreateThread(StartEpollWorker, this);
+  }
+  EpollWorker();
+}
+
+#endif
+
 void CoverageServer::RunServer() {
   num_connections = 0;
 
-  socket_type listen_socket, client_socket;
   struct sockaddr_in serv_addr;
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
@@ -656,7 +1835,7 @@ void CoverageServer::RunServer() {
     FATAL("bind failed");
   }
 
-  if (listen(listen_socket, 10)) {
+  if (listen(listen_socket, SOMAXCONN)) {
     closesocket(listen_socket);
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
     WSACleanup();
@@ -665,10 +1844,26 @@ void CoverageServer::RunServer() {
   }
 
   CreateThread(StartStatusThread, this);
+  CreateThread(StartCrashWriterThread, this);
+
+  if (upstream) {
+    CreateThread(StartRelayThread, this);
+  }
+
+  if (distill_interval > 0) {
+    CreateThread(StartDistillThread, this);
+  }
 
+  if (admin_port) {
+    CreateThread(StartAdminThread, this);
+  }
+
+#ifdef linux
+  RunEpollServer();
+#else
   while (1)
   {
-    client_socket = accept(listen_socket, NULL, NULL);
+    socket_type client_socket = accept(listen_socket, NULL, NULL);
     if (client_socket == INVALID_SOCKET) {
       closesocket(listen_socket);
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
@@ -677,15 +1872,7 @@ void CoverageServer::RunServer() {
       FATAL("accept failed");
     }
 
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
-    DWORD timeout = 10000;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-#else
-    struct timeval tv;
-    tv.tv_sec = 10; // 10 Secs Timeout 
-    tv.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(struct timeval))) {
-#endif
+    if (!SetSocketOptions(client_socket)) {
       closesocket(client_socket);
       closesocket(listen_socket);
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
@@ -699,6 +1886,7 @@ void CoverageServer::RunServer() {
     client_info->server = this;
     CreateThread(StartServerThread, client_info);
   }
+#endif
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
   WSACleanup();
@@ -16,13 +16,19 @@ limitations under the License.
 
 #pragma once
 
+#include <list>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include "sample.h"
 #include "mutex.h"
 
 #include "coverage.h"
+#include "mappedfile.h"
+#include "coveragemap.h"
+#include "fleetstats.h"
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
 #include <windows.h>
@@ -45,8 +51,25 @@ typedef int socket_type;
 
 #endif 
 
+// don't get killed by SIGPIPE when the other side
+// of a persistent connection goes away
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// only used by the thread-per-connection server
 #define MAX_CONNECTIONS 8
 
+// number of threads handling client commands in the epoll server
+#define DEFAULT_SERVER_THREADS 8
+
+// how long the epoll server may spend on a single command before
+// the connection is shut down, and how often that's checked (in seconds)
+#define SERVER_COMMAND_TIMEOUT 60
+#define SERVER_COMMAND_WATCHDOG_INTERVAL 1
+
 #define DEFAULT_SERVER_PORT 8000
 
 // save state every 20 minutes
@@ -54,7 +77,43 @@ typedef int socket_type;
 
 #define MAX_SERVER_IDENTICAL_CRASHES 4
 
+// crashes waiting to be written to disk, crashes
+// reported while the queue is full are only counted
+#define MAX_CRASH_QUEUE_SIZE 1024
+#define CRASH_WRITER_POLL_INTERVAL 100
+// how often crash_summary.txt is updated, in seconds
+#define CRASH_SUMMARY_INTERVAL 10
+
+// upper bound on the size of the bloom filter sent by clients (128MB)
+#define MAX_BLOOM_FILTER_WORDS (1 << 24)
+
+// upper bound on the size of the encoded stats sent by clients
+#define MAX_CLIENT_STATS_SIZE 1024
+
+// upper bound on the size of encoded coverage received from peers (256MB)
+#define MAX_COVERAGE_WIRE_SIZE (256 * 1024 * 1024)
+
+// upper bound on the size of an HTTP request on the admin port
+#define MAX_ADMIN_REQUEST_SIZE 8192
+
+// the server corpus can hold up to
+// CORPUS_SEGMENT_SIZE * MAX_CORPUS_SEGMENTS samples
+#define CORPUS_SEGMENT_SIZE 4096
+#define MAX_CORPUS_SEGMENTS 65536
+
+// how often a relay server exchanges data with its upstream server
+#define DEFAULT_RELAY_INTERVAL 10
+
+// how often the corpus sent to new clients is distilled, in seconds
+#define DEFAULT_DISTILL_INTERVAL 600
+
+// identifies the server_state.dat format that
+// goes together with the packed corpus files
+#define SERVER_STATE_MAGIC 0x32524553534c434aULL
+
 class CoverageServer;
+class CoverageClient;
+class WireWriter;
 
 class ClientSocket {
 public:
@@ -72,11 +131,19 @@ protected:
   int RecvString(socket_type sock, std::string &str);
   int SendCoverage(socket_type sock, Coverage &coverage);
   int RecvCoverage(socket_type sock, Coverage &coverage);
+
+  // wire version 2 (see wire.h)
+  void AppendSampleV2(WireWriter &writer, Sample &sample, bool compress);
+  void AppendSampleV2(WireWriter &writer, const char *bytes, size_t size, bool compress);
+  int RecvSampleV2(socket_type sock, Sample &sample);
+  void AppendCoverageV2(WireWriter &writer, Coverage &coverage);
+  int RecvCoverageV2(socket_type sock, Coverage &coverage);
 };
 
 class CoverageServer : public ServerCommon {
 public:
-  CoverageServer() : server_timestamp(0), server_port(DEFAULT_SERVER_PORT), num_samples(0), num_crashes(0), num_unique_crashes(0) { }
+  CoverageServer() : server_timestamp(0), server_port(DEFAULT_SERVER_PORT), num_samples(0), num_crashes(0), num_unique_crashes(0), num_crashes_dropped(0), num_server_threads(DEFAULT_SERVER_THREADS), compress_samples(false), upstream(NULL), relay_interval(DEFAULT_RELAY_INTERVAL), distill_interval(DEFAULT_DISTILL_INTERVAL), distilled_size(0), admin_port(0), corpus_data_fp(NULL), corpus_index_fp(NULL), journal_fp(NULL), corpus_data_size(0) { }
+  ~CoverageServer();
 
   // for incremental updates
   struct TimestampIndex {
@@ -84,14 +151,92 @@ public:
     uint64_t index;
   };
 
-  struct ServerCorpus {
-    std::vector<Sample> samples;
+  // used to avoid sending clients the samples they already have
+  struct SampleInfo {
+    // 0 for samples reported using wire version 1
+    uint64_t client_id;
+    uint64_t hash;
+  };
+
+  // Append-only corpus. Entries are stored in fixed-size segments
+  // which are never moved or modified once published, so that
+  // ServeUpdates can take a snapshot of the size and send the
+  // entries without holding any lock. Appending (as well as
+  // accessing timestamps and hashes) requires the write lock
+  class ServerCorpus {
+  public:
+    struct Entry {
+      // points either into sample or into the mapped corpus file
+      const char *bytes;
+      size_t size;
+      // only holds the data of samples added since the server started
+      Sample sample;
+      SampleInfo info;
+      // coverage reported together with the sample,
+      // empty if unknown (e.g. for samples from upstream)
+      Coverage coverage;
+    };
+
+    ServerCorpus();
+    ~ServerCorpus();
+
+    void Append(Sample &sample, SampleInfo &info, Coverage *coverage);
+    // for samples whose bytes are in the mapped corpus file
+    void AppendMapped(const char *bytes, size_t size, SampleInfo &info);
+
+    // number of published entries, safe to call without a lock
+    size_t GetSize() { return num_entries.load(std::memory_order_acquire); }
+
+    // index must be smaller than a previously returned GetSize()
+    Entry *Get(size_t index) {
+      return &segments[index / CORPUS_SEGMENT_SIZE][index % CORPUS_SEGMENT_SIZE];
+    }
+
     std::vector<TimestampIndex> timestamps;
+    std::unordered_set<uint64_t> hashes;
+
+  protected:
+    Entry *GetNextEntry();
+    void Publish();
+
+    // allocated once and never resized
+    std::vector<Entry *> segments;
+    std::atomic<size_t> num_entries;
+  };
+
+  // On disk, the corpus is stored in a single packed data file and
+  // an index file, both of which are only ever appended to. When
+  // restoring, the data file is mapped into memory so that samples
+  // are paged in only when they are sent to clients. Coverage and
+  // timestamps are appended to a journal as they change, which is
+  // replayed (and compacted) when restoring
+  struct CorpusIndexEntry {
+    uint64_t offset;
+    uint64_t size;
+    SampleInfo info;
   };
 
+  void CreateStorage();
+  void LoadStorage();
+  void RestoreLegacyState();
+  void PersistSample(ServerCorpus::Entry *entry);
+  void WriteJournal(FILE *fp);
+  void ReplayJournal(FILE *fp);
+  void JournalCoverage(FILE *fp, uint64_t timestamp, Coverage &coverage);
+  void JournalSamples(FILE *fp, uint64_t timestamp, uint64_t first_index, uint64_t count);
+  void JournalSampleCoverage(FILE *fp, uint64_t index, Coverage &coverage);
+  void WriteJournalCoverage(FILE *fp, Coverage &coverage);
+  bool ReadJournalCoverage(FILE *fp, Coverage &coverage);
+
+  FILE *corpus_data_fp;
+  FILE *corpus_index_fp;
+  FILE *journal_fp;
+  uint64_t corpus_data_size;
+  MappedFile corpus_map;
+
   ServerCorpus corpus;
 
-  Coverage total_coverage;
+  CoverageMap total_coverage;
 
   std::string out_dir;
 
@@ -105,23 +250,110 @@ public:
   Mutex connection_mutex;
   size_t num_connections;
 
-  int ServeUpdates(socket_type sock);
-  int ReportCrash(socket_type sock);
-  int ReportNewCoverage(socket_type sock);
+  int ServeUpdates(socket_type sock, int wire_version);
+  int ReportCrash(socket_type sock, int wire_version);
+  int ReportNewCoverage(socket_type sock, int wire_version);
+  int NegotiateWireVersion(socket_type sock);
   uint64_t GetIndex(std::vector<TimestampIndex> &timestamps, uint64_t timestamp, uint64_t last_index);
 
   void SaveState();
   void RestoreState();
 
-  bool OnNewCoverage(Coverage *client_coverage);
-  void UpdateModuleCoverage(ModuleCoverage *client_coverage);
-  bool HasNewCoverage(Coverage *client_coverage, Coverage *new_coverage);
+  // stores the samples that aren't in the corpus yet and removes
+  // the duplicates from the lists. sample_coverage holds the coverage
+  // of each sample (empty if unknown). Requires the write lock
+  void StoreSamples(std::list<Sample> &new_samples, std::list<Coverage> &sample_coverage, uint64_t client_id);
 
   void RunServer();
   int HandleConnection(socket_type sock);
+  int HandleCommand(socket_type sock, char command);
+  bool SetSocketOptions(socket_type sock);
+
+#ifdef linux
+  // clients keep their connections open and send multiple
+  // commands over them. Idle connections are parked in epoll
+  // and a fixed pool of threads handles the commands
+  void RunEpollServer();
+  void EpollWorker();
+  void AcceptConnections();
+  void CloseConnection(socket_type sock);
+  bool ArmSocket(socket_type sock, int op);
+
+  // Updates can be large, so they are sent as the client reads them
+  // instead of blocking a worker until the client has read them all.
+  // Connections with a reply in pending_replies wait in epoll until
+  // they are writable and only read the next command once the reply
+  // was sent. Protected by connection_mutex
+  std::unordered_map<socket_type, WireWriter *> pending_replies;
+  int SendReply(socket_type sock, WireWriter &writer);
+  int SendPendingReply(socket_type sock);
+
+  // Commands are read with blocking I/O, where the receive timeout
+  // only bounds each recv, so a client trickling a command in would
+  // hold a worker. command_start_times has the start of the command
+  // each connection is handling, and CommandWatchdog shuts down
+  // connections whose command takes longer than SERVER_COMMAND_TIMEOUT,
+  // which fails the worker's reads and writes right away.
+  // Protected by connection_mutex
+  std::unordered_map<socket_type, uint64_t> command_start_times;
+  void CommandWatchdog();
+
+  int epoll_fd;
+#endif
+
+  socket_type listen_socket;
+  int num_server_threads;
+
+  // compress samples served to clients using wire version 2
+  bool compress_samples;
 
   void StatusThread();
 
+  // Clients send their stats with each update request, which are
+  // kept as a time series per client. If -admin_port is given,
+  // the stats are served over HTTP on the local machine,
+  // as JSON on / or /stats and as Prometheus text on /metrics
+  FleetStats fleet_stats;
+  int admin_port;
+
+  void AdminThread();
+  int ServeAdminRequest(socket_type sock);
+
+  // A server started with -server also acts as a client of
+  // another (upstream) server. Such a relay handles its own clients
+  // as usual, but periodically forwards the coverage, samples and
+  // crashes that are new to it upstream, and adds the samples
+  // it gets from upstream to its own corpus, so that many
+  // fuzzers can be connected to a single server through a tree
+  // of relays.
+  void RelayThread();
+  void SyncWithUpstream();
+
+  // Clients starting from scratch don't need the full corpus
+  // history, only a subset of the samples that covers everything.
+  // The distiller thread periodically computes such a subset
+  // (greedy set cover over the reported per-sample coverage) of
+  // the corpus entries up to distilled_size. New clients get these
+  // samples, followed by all samples after distilled_size
+  void DistillThread();
+  void DistillCorpus();
+
+  int distill_interval;
+
+  // protected by distill_mutex
+  Mutex distill_mutex;
+  std::vector<size_t> distilled_samples;
+  size_t distilled_size;
+
+  CoverageClient *upstream;
+  int relay_interval;
+
+  // pending data to forward upstream, protected by relay_mutex
+  Mutex relay_mutex;
+  Coverage relay_coverage;
+  std::list<Sample *> relay_samples;
+  std::list<std::pair<Sample *, std::string>> relay_crashes;
+
   void Init(int argc, char **argv);
   void SetupDirectories();
 
@@ -131,9 +363,37 @@ public:
 
   ReadWriteMutex mutex;
 
-  // separate mutex for writing crashes
+  // Crashes are deduplicated and counted while handling the
+  // report, which is cheap, and written to disk by a separate
+  // thread so that clients never wait on disk I/O
+  struct CrashBucket {
+    CrashBucket(uint64_t cur_time) : hits(0), stored(0), hits_at_last_summary(0),
+      first_seen(cur_time), last_seen(cur_time) { }
+
+    uint64_t hits;
+    uint64_t stored;
+    uint64_t hits_at_last_summary;
+    // unix time
+    uint64_t first_seen;
+    uint64_t last_seen;
+    // hashes of the stored inputs, so at most
+    // MAX_SERVER_IDENTICAL_CRASHES of them
+    std::vector<uint64_t> hashes;
+  };
+
+  struct PendingCrash {
+    Sample *sample;
+    std::string filename;
+  };
+
+  void CrashWriterThread();
+  void WriteCrashSummary();
+
+  // protects everything crash related
   Mutex crash_mutex;
-  std::unordered_map<std::string, int> unique_crashes;
+  std::unordered_map<std::string, CrashBucket> crash_buckets;
+  std::list<PendingCrash> crash_queue;
+  size_t num_crashes_dropped;
 
   std::string server_ip;
   uint16_t server_port;
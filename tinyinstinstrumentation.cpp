@@ -29,12 +29,15 @@ void TinyInstInstrumentation::Init(int argc, char **argv) {
 
   persist = GetBinaryOption("-persist", argc, argv, false);
   num_iterations = GetIntOption("-iterations", argc, argv, 1);
+  num_target_starts = 0;
 }
 
 RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_timeout, uint32_t timeout) {
   DebuggerStatus status;
   RunResult ret = OTHER_ERROR;
 
+  num_target_starts = 0;
+
   if (instrumentation->IsTargetFunctionDefined()) {
     if (cur_iteration == num_iterations) {
       instrumentation->Kill();
@@ -57,6 +60,7 @@ RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_time
   } else {
     instrumentation->Kill();
     cur_iteration = 0;
+    num_target_starts++;
     status = instrumentation->Run(argc, argv, timeout1);
   }
 
@@ -68,6 +72,7 @@ RunResult TinyInstInstrumentation::Run(int argc, char **argv, uint32_t init_time
       WARN("Target function not reached, retrying with a clean process\n");
       instrumentation->Kill();
       cur_iteration = 0;
+      num_target_starts++;
       status = instrumentation->Run(argc, argv, init_timeout);
     }
 
@@ -44,10 +44,13 @@ public:
 
   std::string GetCrashName() override;
 
+  uint32_t GetNumTargetStarts() override { return num_target_starts; }
+
 protected:
   LiteCov * instrumentation;
   bool persist;
   int num_iterations;
   int cur_iteration;
+  uint32_t num_target_starts;
 };
 
@@ -0,0 +1,245 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <string.h>
+
+#include "wire.h"
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+#include <errno.h>
+#include <sys/uio.h>
+#endif
+
+// maximum number of buffers passed to a single writev
+#define WIRE_MAX_IOVECS 512
+
+// the referenced data is only worth not copying if it's large enough
+#define WIRE_MIN_REF_SIZE 256
+
+void WireWriter::Append(const void *data, size_t size) {
+  if (!size) return;
+
+  if (!segments.empty() && !segments.back().ref &&
+      (segments.back().offset + segments.back().size == buffer.size()))
+  {
+    segments.back().size += size;
+  } else {
+    segments.push_back({ NULL, buffer.size(), size });
+  }
+
+  buffer.append((const char *)data, size);
+}
+
+void WireWriter::AppendRef(const void *data, size_t size) {
+  if (size < WIRE_MIN_REF_SIZE) {
+    Append(data, size);
+    return;
+  }
+  segments.push_back({ (const char *)data, 0, size });
+}
+
+void WireWriter::Clear() {
+  buffer.clear();
+  segments.clear();
+  next_segment = 0;
+}
+
+int WireWriter::Flush(socket_type sock) {
+  int ret = 1;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32)
+  for (auto iter = segments.begin(); iter != segments.end(); iter++) {
+    const char *p = iter->ref ? iter->ref : buffer.data() + iter->offset;
+    size_t to_write = iter->size;
+    while (to_write) {
+      int write_chunk = (to_write > 0x100000) ? 0x100000 : (int)to_write;
+      int sent = send(sock, p, write_chunk, 0);
+      if (sent <= 0) {
+        ret = 0;
+        break;
+      }
+      to_write -= sent;
+      p += sent;
+    }
+    if (!ret) break;
+  }
+#else
+  std::vector<struct iovec> iovecs;
+  for (auto iter = segments.begin(); iter != segments.end(); iter++) {
+    struct iovec iov;
+    iov.iov_base = (void *)(iter->ref ? iter->ref : buffer.data() + iter->offset);
+    iov.iov_len = iter->size;
+    iovecs.push_back(iov);
+  }
+
+  size_t cur = 0;
+  while (cur < iovecs.size()) {
+    size_t count = iovecs.size() - cur;
+    if (count > WIRE_MAX_IOVECS) count = WIRE_MAX_IOVECS;
+
+    // sendmsg instead of writev so that SEND_FLAGS apply
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iovecs[cur];
+    msg.msg_iovlen = count;
+
+    ssize_t sent = sendmsg(sock, &msg, SEND_FLAGS);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) {
+      ret = 0;
+      break;
+    }
+
+    // skip over what was sent, adjusting a partially sent buffer
+    while (sent > 0 && cur < iovecs.size()) {
+      if ((size_t)sent >= iovecs[cur].iov_len) {
+        sent -= iovecs[cur].iov_len;
+        cur++;
+      } else {
+        iovecs[cur].iov_base = (char *)iovecs[cur].iov_base + sent;
+        iovecs[cur].iov_len -= sent;
+        sent = 0;
+      }
+    }
+  }
+#endif
+
+  Clear();
+  return ret;
+}
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+int WireWriter::FlushNonBlocking(socket_type sock) {
+  while (next_segment < segments.size()) {
+    std::vector<struct iovec> iovecs;
+    for (size_t i = next_segment; (i < segments.size()) && (iovecs.size() < WIRE_MAX_IOVECS); i++) {
+      struct iovec iov;
+      iov.iov_base = (void *)(segments[i].ref ? segments[i].ref : buffer.data() + segments[i].offset);
+      iov.iov_len = segments[i].size;
+      iovecs.push_back(iov);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iovecs[0];
+    msg.msg_iovlen = iovecs.size();
+
+    ssize_t sent = sendmsg(sock, &msg, SEND_FLAGS | MSG_DONTWAIT);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -1;
+    if (sent <= 0) return 0;
+
+    // skip over what was sent, adjusting a partially sent segment
+    while (sent > 0) {
+      Segment &segment = segments[next_segment];
+      if ((size_t)sent >= segment.size) {
+        sent -= segment.size;
+        next_segment++;
+      } else {
+        if (segment.ref) {
+          segment.ref += sent;
+        } else {
+          segment.offset += sent;
+        }
+        segment.size -= sent;
+        sent = 0;
+      }
+    }
+  }
+
+  Clear();
+  return 1;
+}
+#endif
+
+void EncodeVarint(uint64_t value, std::string &out) {
+  while (value >= 0x80) {
+    out.push_back((char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back((char)value);
+}
+
+bool DecodeVarint(const char **data, const char *end, uint64_t *value) {
+  uint64_t ret = 0;
+  const char *p = *data;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (p >= end) return false;
+    unsigned char c = (unsigned char)*p++;
+    // the last byte only has room for the top bit
+    if ((shift == 63) && (c & 0x7e)) return false;
+    ret |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *data = p;
+      *value = ret;
+      return true;
+    }
+  }
+  return false;
+}
+
+void EncodeCoverage(Coverage &coverage, std::string &out) {
+  EncodeVarint(coverage.size(), out);
+  for (auto iter = coverage.begin(); iter != coverage.end(); iter++) {
+    EncodeVarint(iter->module_name.size(), out);
+    out.append(iter->module_name);
+    EncodeVarint(iter->offsets.size(), out);
+    uint64_t last_offset = 0;
+    for (auto iter2 = iter->offsets.begin(); iter2 != iter->offsets.end(); iter2++) {
+      EncodeVarint(*iter2 - last_offset, out);
+      last_offset = *iter2;
+    }
+  }
+}
+
+bool DecodeCoverage(const char *data, size_t size, Coverage &coverage) {
+  const char *end = data + size;
+  uint64_t num_modules;
+
+  if (!DecodeVarint(&data, end, &num_modules)) return false;
+
+  for (uint64_t i = 0; i < num_modules; i++) {
+    uint64_t name_size;
+    if (!DecodeVarint(&data, end, &name_size)) return false;
+    if (name_size > (uint64_t)(end - data)) return false;
+    std::string module_name(data, (size_t)name_size);
+    data += name_size;
+
+    ModuleCoverage *module_coverage = GetModuleCoverage(coverage, module_name);
+    if (!module_coverage) {
+      coverage.push_back({ module_name, {} });
+      module_coverage = GetModuleCoverage(coverage, module_name);
+    }
+
+    uint64_t num_offsets;
+    if (!DecodeVarint(&data, end, &num_offsets)) return false;
+    // each offset takes at least one byte
+    if (num_offsets > (uint64_t)(end - data)) return false;
+
+    uint64_t offset = 0;
+    for (uint64_t j = 0; j < num_offsets; j++) {
+      uint64_t delta;
+      if (!DecodeVarint(&data, end, &delta)) return false;
+      offset += delta;
+      // offsets are sorted, so hint the insert position
+      module_coverage->offsets.insert(module_coverage->offsets.end(), offset);
+    }
+  }
+
+  return (data == end);
+}
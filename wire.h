@@ -0,0 +1,83 @@
+/*
+Copyright 2020 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+#include "coverage.h"
+#include "server.h"
+
+// Version 1 is the original protocol with raw offset arrays.
+// Version 2 adds varint + delta encoded coverage and optionally
+// compressed samples. Clients negotiate the version with the
+// 'V' command and use separate command letters for version 2.
+// Version 3 adds the client id to coverage reports ('r') and the
+// samples the client already has to update requests ('k').
+// Version 4 adds client stats (see fleetstats.h) to update requests ('q').
+// Version 5 adds update requests that get the coverage of each sample
+// along with it ('g'), used by relays
+#define WIRE_VERSION 5
+
+// flags for samples sent with wire version 2
+#define WIRE_SAMPLE_COMPRESSED 1
+
+// Collects a message in memory and sends it with as few
+// system calls as possible. Small fields are copied into an
+// internal buffer while large payloads (such as sample bytes)
+// are only referenced and must stay valid until Flush()
+class WireWriter {
+public:
+  WireWriter() : next_segment(0) { }
+
+  void Append(const void *data, size_t size);
+  void AppendRef(const void *data, size_t size);
+  void AppendByte(char c) { Append(&c, 1); }
+  void AppendU64(uint64_t value) { Append(&value, sizeof(value)); }
+
+  // returns 1 on success, 0 if the socket failed
+  int Flush(socket_type sock);
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32)
+  // sends as much as the socket takes without blocking. Returns 1
+  // once everything was sent, -1 if the rest needs to be sent once
+  // the socket is writable again and 0 if the socket failed
+  int FlushNonBlocking(socket_type sock);
+#endif
+  void Clear();
+
+protected:
+  struct Segment {
+    // NULL for data in buffer
+    const char *ref;
+    size_t offset;
+    size_t size;
+  };
+
+  std::string buffer;
+  std::vector<Segment> segments;
+  // first segment not fully sent by FlushNonBlocking
+  size_t next_segment;
+};
+
+void EncodeVarint(uint64_t value, std::string &out);
+bool DecodeVarint(const char **data, const char *end, uint64_t *value);
+
+// offsets of each module are sorted (std::set), so only
+// deltas between consecutive offsets are encoded
+void EncodeCoverage(Coverage &coverage, std::string &out);
+bool DecodeCoverage(const char *data, size_t size, Coverage &coverage);